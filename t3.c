@@ -20,6 +20,10 @@
  * to the provided filename and to its own stdout and stderr streams.
  */
 
+// Expose posix_openpt() and friends (and the other POSIX/XSI interfaces used
+// below) in glibc's headers. Must precede the first system #include.
+#define _GNU_SOURCE
+
 /*
  * Include <TargetConditionals.h> to address error:
  *   'TARGET_OS_IPHONE' is not defined
@@ -30,32 +34,47 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
-// Size of the chunk a worker reads from the command at a time, and the
-// initial capacity of its line-assembly buffer. Lines longer than this are
-// handled by growing the buffer (see MAX_LINE_SIZE), not by splitting.
+// Size of the chunk a worker reads from the command at a time.
 // https://stackoverflow.com/questions/3552095/sensible-line-buffer-size-in-c
 #define BUFFER_SIZE 4096
 
-// Upper bound on a single reassembled line. A worker's line buffer grows as
-// needed up to this cap; a line longer than the cap is forwarded in cap-sized
-// pieces so that pathological input (e.g. a command emitting megabytes with no
-// newline) cannot drive unbounded memory growth.
+// Upper bound on the text of a single frame, and so on what the parent ever
+// has to buffer of one.
 #define MAX_LINE_SIZE (16 * 1024 * 1024)
 
+// Most of a line a worker holds before forwarding it. A longer line is
+// streamed on in pieces of this size, each flagged MSG_CONTINUED but the last,
+// and the parent renders them back into a single line, so pathological input
+// (e.g. a command emitting megabytes with no newline) neither drives memory
+// growth nor gets broken up in the output.
+#define LINE_CHUNK_SIZE (1024 * 1024)
+
 // How long (in milliseconds) the parent holds a line in its queue before
 // emitting it.  This grace period lets a slightly-later line from the *other*
 // stream arrive so the two streams can be interleaved in timestamp order
@@ -66,6 +85,19 @@
 // message from either worker before looping to flush any aged-out messages.
 #define POLL_TIMEOUT_MS 1000
 
+// Most record bytes a --listen subscriber may have queued in t3, not yet
+// accepted by its socket, before t3 gives up on it and disconnects it.
+#define SUBSCRIBER_BUFFER_SIZE (1024 * 1024)
+
+// Most bytes t3 queues for its stdout or stderr while the consumer is not
+// reading (e.g. a paused `| less`). Past this, writing a line waits for the
+// consumer, and so eventually does the command.
+#define TTY_BACKLOG_SIZE (16 * 1024 * 1024)
+
+// How long (in milliseconds) t3 spends at exit handing the records still
+// queued for --listen subscribers to their sockets.
+#define SUBSCRIBER_CLOSE_TIMEOUT_MS 1000
+
 // A few ANSI color codes, see https://materialui.co/colors
 #define ANSI_COLOR_RESET "\x1b[0m"
 #define ANSI_COLOR_BOLD "\x1b[1m"
@@ -100,16 +132,91 @@ const char *reset_color = ANSI_COLOR_RESET;
 struct timespec start_timestamp;
 enum output_error_mode output_error = OUTPUT_ERROR_DEFAULT;
 // Set once a sink has failed so we stop writing to it (and avoid repeat
-// diagnostics). The logfile is also re-checked when it is closed.
+// diagnostics). Log files track this per sink (struct log_sink) and are also
+// re-checked when they are closed.
 int stdout_broken = 0;
 int stderr_broken = 0;
-int logfile_broken = 0;
 // Set when a fatal --output-error policy (exit / exit-nopipe, or the default
 // broken-pipe case) fires. Rather than exit() from inside the drain loop -
-// which would skip closing the logfile and reaping children - the loop breaks
+// which would skip closing the log files and reaping children - the loop breaks
 // to a shared teardown that exits with failure status (tee-faithful: the write
 // error overrides the command's own status).
 int output_error_fatal = 0;
+// Set when a worker's message stream fails its handshake or is corrupt. The
+// command is already running by then, so this too breaks the drain loop to a
+// teardown that stops and reaps the command and workers before exiting.
+int worker_failed = 0;
+// --strip-ansi / --log-strip-ansi: remove the command's own escape sequences
+// from what goes to stdout/stderr and to the log files respectively.
+int strip_ansi_tty = 0;
+int strip_ansi_log = 0;
+
+// Record format of a log file (--log-format, --log).
+enum log_format {
+  LOG_FORMAT_TEXT,  // colorized, optionally timestamped text, as on a terminal
+  LOG_FORMAT_PLAIN, // the same without any color
+  LOG_FORMAT_JSONL  // one JSON object per line: timestamp, stream, and text
+};
+#define LOG_FORMAT_COUNT 3
+
+// Bits naming the command's streams, for a log sink's stream filter.
+#define STREAM_STDOUT 1
+#define STREAM_STDERR 2
+
+// A log file: the FILE named on the command line and any added with --log.
+// Each has its own record format and may record only one of the streams.
+struct log_sink {
+  const char *name; // for diagnostics: "logfile" for the primary log file
+  const char *path;
+  FILE *fp;
+  enum log_format format;
+  int streams; // STREAM_STDOUT and/or STREAM_STDERR
+  int broken;  // set once a write has failed
+  // Only regular files rotate or have their page cache released, so not
+  // e.g. /dev/null or a FIFO.
+  int regular;
+  off_t bytes; // in the current file or segment
+  // Rotation state (--rotate-size, --rotate-interval)
+  time_t segment_start; // when the current segment was started
+  unsigned segment;     // number of the last closed segment, FILE.<segment>
+  FILE *spare;          // the next segment, opened ahead of the rotation
+  char *spare_path;
+  int no_spare; // set once the spare could not be created; rotation stops
+  // --ring: write records into a fixed-size circular file instead (fp unused)
+  off_t ring_size;
+  struct ring_header *ring;
+  // --log-nocache state, as offsets in the current file
+  off_t cache_mark;   // `bytes` when the cache was last released
+  off_t released;     // below this the cache has been dropped
+  off_t written_back; // below this writeback has at least been started
+  off_t prealloc_end; // end of the extents reserved past the cursor; -1 if
+                      // the filesystem cannot preallocate
+  uint64_t blocked_ns; // --stats: time spent writing records
+};
+struct log_sink *log_sinks = NULL;
+int num_log_sinks = 0;
+
+// Log rotation: start a new segment once the current one would exceed
+// rotate_size bytes or is rotate_interval seconds old (0 disables either).
+off_t rotate_size = 0;
+time_t rotate_interval = 0;
+int rotate_compress = 0;
+// gzip processes compressing closed segments (--rotate-compress).
+pid_t *compressors = NULL;
+int num_compressors = 0;
+
+// --sync: when log file data is forced to stable storage. The default leaves
+// that to the kernel; the others sync at exit and, for interval and bytes,
+// also in batches on a background thread while the command runs.
+enum sync_mode { SYNC_NONE, SYNC_INTERVAL, SYNC_BYTES, SYNC_EXIT };
+enum sync_mode sync_mode = SYNC_NONE;
+long sync_interval_ms = 0;
+off_t sync_threshold = 0;
+// Bytes handed to the log files so far, for --sync's batching and lag.
+off_t logged_bytes = 0;
+
+// The environment handed to the command (see posix_spawnp() in main()).
+extern char **environ;
 
 // Diagnostic macros. Each expands to a single statement (wrapped in
 // do/while(0)) so it behaves correctly when used as the body of an
@@ -122,25 +229,76 @@ int output_error_fatal = 0;
               getpid(), ##__VA_ARGS__);                                        \
   } while (0)
 #define _warn(format, ...)                                                     \
-  fprintf(stderr,                                                              \
-          ANSI_COLOR_YELLOW "WARNING[%d]: " ANSI_COLOR_RESET format "\n",      \
-          getpid(), ##__VA_ARGS__)
+  diag_printf(ANSI_COLOR_YELLOW "WARNING[%d]: " ANSI_COLOR_RESET format "\n",  \
+              getpid(), ##__VA_ARGS__)
 #define _error(format, ...)                                                    \
-  fprintf(stderr, ANSI_COLOR_RED "ERROR[%d]: " ANSI_COLOR_RESET format "\n",   \
-          getpid(), ##__VA_ARGS__)
+  diag_printf(ANSI_COLOR_RED "ERROR[%d]: " ANSI_COLOR_RESET format "\n",       \
+              getpid(), ##__VA_ARGS__)
+
+void write_tty(FILE *stream, const char *buf, size_t len);
+
+// The main thread of the main t3 process, the one that owns the stdout and
+// stderr backlogs (see struct tty_out). Set at the start of main().
+static pid_t main_pid = 0;
+static pthread_t main_thread;
+
+// printf() to t3's stderr through write_tty(), behind whatever is queued there,
+// so that t3's own messages never land in the middle of a queued line.
+static void tty_vprintf(const char *format, va_list ap) {
+  char *text;
+  int len = vasprintf(&text, format, ap);
+  if (len >= 0) {
+    write_tty(stderr, text, (size_t)len);
+    free(text);
+  }
+}
+
+static void tty_printf(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+static void tty_printf(const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  tty_vprintf(format, ap);
+  va_end(ap);
+}
+
+// Print a warning or error: through the stderr backlog in the main thread,
+// and directly from the workers and other threads, which have none.
+static void diag_printf(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+static void diag_printf(const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  if (getpid() == main_pid && pthread_equal(pthread_self(), main_thread)) {
+    tty_vprintf(format, ap);
+  } else {
+    vfprintf(stderr, format, ap);
+  }
+  va_end(ap);
+}
 
 // Wire format of one message on a worker's message pipe: a fixed header
 // followed immediately by `length` bytes of line text (no trailing NUL). Each
 // message pipe has a single writer (its worker), so frames never interleave;
-// write_full()/read_full() keep them aligned across partial transfers.
+// write_full() and the parent's framereader keep them aligned across partial
+// transfers.
 struct msg_header {
   struct timespec timestamp;
   uint32_t length;
+  uint32_t flags;
 };
 
+// Set on a frame that carries only part of a line: the rest follows in the
+// next frame(s) on the same stream, the last of which has it clear.
+#define MSG_CONTINUED 1
+
+// Set, along with MSG_CONTINUED, on a piece forwarded by --partial-flush: the
+// line went without its newline for too long, rather than being too long.
+#define MSG_PARTIAL 2
+
 // Largest legitimate frame on the wire: a full header plus a maximally long
-// line. A worker never sends more than this, so the parent's read buffer
-// never needs to grow beyond it.
+// line. A worker never sends more than this, so it is the size reserved for
+// the parent's read buffer.
 #define MAX_FRAME_SIZE (sizeof(struct msg_header) + MAX_LINE_SIZE)
 
 // In-memory message held on the parent's queues. The text is stored inline as
@@ -149,6 +307,7 @@ struct msg_header {
 struct payload {
   struct timespec timestamp;
   uint32_t length;
+  uint32_t flags; // MSG_CONTINUED, MSG_PARTIAL
   char text[];
 };
 
@@ -161,9 +320,11 @@ struct message {
 struct message *stdout_head = NULL;
 struct message *stdout_tail = NULL;
 int stdout_queuelen = 0;
+size_t stdout_queued_bytes = 0; // text bytes of the lines queued
 struct message *stderr_head = NULL;
 struct message *stderr_tail = NULL;
 int stderr_queuelen = 0;
+size_t stderr_queued_bytes = 0;
 
 // Install a disposition for a signal using sigaction(2), whose semantics are
 // well-defined across platforms (unlike signal(2), whose SysV/BSD behavior has
@@ -192,6 +353,37 @@ static void *xmalloc(size_t size) {
   return ptr;
 }
 
+// --hugepages: ask for transparent huge pages behind the large buffers below.
+int use_hugepages = 0;
+
+// Reserve `size` bytes of address space for a buffer that grows in place up
+// to that size. The range is an anonymous mapping, which the kernel backs
+// with memory only as its pages are first touched, so growing the buffer is
+// just a matter of using more of it: nothing is reallocated or copied, and
+// the untouched tail costs nothing. With --hugepages the range is marked for
+// transparent huge pages, trading memory granularity for fewer TLB misses on
+// very long lines. Aborts on failure, like xmalloc().
+static char *vbuf_reserve(size_t size) {
+  void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (buf == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+#ifdef MADV_HUGEPAGE
+  if (use_hugepages) {
+    madvise(buf, size, MADV_HUGEPAGE);
+  }
+#endif
+  return buf;
+}
+
+static void vbuf_release(char *buf, size_t size) {
+  if (buf) {
+    munmap(buf, size);
+  }
+}
+
 // realloc() that aborts on failure, with the same rationale as xmalloc().
 static void *xrealloc(void *ptr, size_t size) {
   void *new_ptr = realloc(ptr, size);
@@ -202,6 +394,30 @@ static void *xrealloc(void *ptr, size_t size) {
   return new_ptr;
 }
 
+// A growable byte buffer. `buf` is not NUL-terminated.
+struct strbuf {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+static void strbuf_append(struct strbuf *sb, const char *data, size_t n) {
+  if (sb->len + n > sb->cap) {
+    size_t cap = sb->cap ? sb->cap : 256;
+    while (cap < sb->len + n) {
+      cap *= 2;
+    }
+    sb->buf = xrealloc(sb->buf, cap);
+    sb->cap = cap;
+  }
+  memcpy(sb->buf + sb->len, data, n);
+  sb->len += n;
+}
+
+static void strbuf_puts(struct strbuf *sb, const char *s) {
+  strbuf_append(sb, s, strlen(s));
+}
+
 // Write exactly `count` bytes from `buf` to `fd`, resuming after partial
 // writes and retrying when interrupted by a signal. Returns 0 on success or
 // -1 on error (with errno set). A pipe write of more than PIPE_BUF bytes is
@@ -223,33 +439,44 @@ static int write_full(int fd, const void *buf, size_t count) {
   return 0;
 }
 
-// Read exactly `count` bytes from `fd` into `buf`, resuming after partial
-// reads and retrying when interrupted by a signal. Returns 1 on success,
-// 0 on a clean end-of-file that falls on a message boundary (nothing read),
-// or -1 on error or a truncated message (errno is set to 0 to distinguish a
-// short read at EOF from a genuine read() error).
-static int read_full(int fd, void *buf, size_t count) {
-  char *cursor = buf;
-  size_t remaining = count;
-  while (remaining > 0) {
-    ssize_t bytes_read = read(fd, cursor, remaining);
-    if (bytes_read < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      return -1;
-    }
-    if (bytes_read == 0) {
-      if (remaining == count) {
-        return 0; // EOF exactly on a message boundary
+// Create a pseudo-terminal laid out like the result of pipe(2): fds[0] is the
+// master, read by a worker, and fds[1] the slave, handed to the command as its
+// stdout or stderr. A command writing to a terminal keeps stdio's line
+// buffering, whereas on a pipe it switches to full buffering and t3 would
+// timestamp whole blocks rather than individual lines. Output post-processing
+// is disabled on the slave so "\n" is not rewritten as "\r\n", and the slave
+// takes on the window size of t3's own stdout when that is a terminal.
+// Returns 0 on success or -1 on error (with errno set).
+static int open_pty(int fds[2]) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master == -1) {
+    return -1;
+  }
+  const char *slave_name = NULL;
+  int slave = -1;
+  struct termios tio;
+  if (grantpt(master) == 0 && unlockpt(master) == 0 &&
+      (slave_name = ptsname(master)) != NULL &&
+      (slave = open(slave_name, O_RDWR | O_NOCTTY)) != -1 &&
+      tcgetattr(slave, &tio) == 0) {
+    tio.c_oflag &= ~OPOST;
+    if (tcsetattr(slave, TCSANOW, &tio) == 0) {
+      struct winsize ws;
+      if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+        ioctl(slave, TIOCSWINSZ, &ws); // cosmetic only; ignore failure
       }
-      errno = 0; // truncated message: distinguish from a read() error
-      return -1;
+      fds[0] = master;
+      fds[1] = slave;
+      return 0;
     }
-    cursor += bytes_read;
-    remaining -= (size_t)bytes_read;
   }
-  return 1;
+  int err = errno;
+  if (slave != -1) {
+    close(slave);
+  }
+  close(master);
+  errno = err;
+  return -1;
 }
 
 static void usage(const int rc) {
@@ -286,69 +513,455 @@ static void usage(const int rc) {
          "                    A bare --output-error means warn; with no\n"
          "                    --output-error, t3 exits on a broken pipe and\n"
          "                    warns on other write errors.\n");
+  printf("  --strip-ansi      "
+         "remove the command's ANSI escape sequences from stdout/err\n");
+  printf("  --log-strip-ansi  "
+         "remove the command's ANSI escape sequences from the log file\n");
+  printf("  --log-compact-cr  "
+         "log a line redrawn with '\\r' (a progress bar) only as it\n"
+         "                    finally stands\n");
+  printf("  --log-format=FMT  "
+         "write the log file as FMT: text (default), plain (text\n"
+         "                    without color) or jsonl (one JSON object per\n"
+         "                    line with ts, stream and text)\n");
+  printf("  --log=FILE[:FMT][:STREAM]  "
+         "also log to FILE as FMT (default text),\n"
+         "                    recording STREAM: stdout, stderr or both\n"
+         "                    (default both); may be given more than once\n");
+  printf("  --listen=SOCKET   "
+         "stream every line as a JSON Lines record to the readers\n"
+         "                    connected to the Unix-domain socket SOCKET\n");
+  printf("  --rotate-size=SIZE  "
+         "start a new log segment, renaming the full one to\n"
+         "                    FILE.N, before FILE exceeds SIZE bytes\n"
+         "                    (K, M and G suffixes accepted)\n");
+  printf("  --rotate-interval=TIME  "
+         "start a new log segment once FILE is TIME seconds\n"
+         "                    old (s, m, h and d suffixes accepted)\n");
+  printf("  --rotate-compress "
+         "compress each closed log segment with gzip\n");
+  printf("  --ring=SIZE       "
+         "keep only the last SIZE bytes of records in FILE, a\n"
+         "                    fixed-size circular file (K, M and G suffixes\n"
+         "                    accepted); read it back with --ring-read\n");
+  printf("  --ring-read=FILE  "
+         "print the records of ring file FILE oldest first, and exit\n");
+  printf("  --sync=POLICY     "
+         "force log data to stable storage: none (default),\n"
+         "                    exit, interval:MS or bytes:N; interval and\n"
+         "                    bytes sync in batches on a background thread\n");
+  printf("  --log-nocache     "
+         "keep written log data out of the page cache, and\n"
+         "                    preallocate log files in large extents\n");
+  printf("  --collapse-repeats  "
+         "replace a run of identical lines on a stream with the\n"
+         "                    first line and a count of the repeats\n");
+  printf("  --highlight=PATTERN=COLOR  "
+         "color lines containing PATTERN, a list of\n"
+         "                    strings separated by '|', in COLOR (a color\n"
+         "                    name such as red or bold, or an escape sequence)\n");
+  printf("  --grep-out=PATTERN  "
+         "keep lines containing PATTERN off stdout/err; they\n"
+         "                    are still logged\n");
+  printf("  --tty-max-rate=N  "
+         "write at most N lines per second to stdout/err, eliding\n"
+         "                    the excess there (but not from the log files)\n");
+  printf("  --partial-flush=MS  "
+         "forward a line still without its newline after MS\n"
+         "                    milliseconds (a prompt, a progress bar) rather\n"
+         "                    than waiting for the rest; '\\r' redraws it on\n"
+         "                    stdout/err\n");
+  printf("  --stats           "
+         "report queue peaks and the time t3's workers and\n"
+         "                    outputs spent blocked to stderr, at exit and on\n"
+         "                    SIGUSR1\n");
+  printf("  --threads         "
+         "read the command's output in threads rather than in\n"
+         "                    forked worker processes\n");
+  printf("  --cpus=LIST       "
+         "run t3's own processes and threads (not the command) on\n"
+         "                    the CPUs in LIST, e.g. 0-3,8\n");
+  printf("  --nice=N          "
+         "lower the priority of t3's own processes and threads by N\n");
+  printf("  --sched=POLICY    "
+         "schedule t3's own processes and threads as batch or idle\n");
+  printf("  --numa-local      "
+         "keep t3's own processes and threads on the NUMA node it\n"
+         "                    starts on\n");
+  printf("  --hugepages       "
+         "back the buffers for long lines with huge pages\n");
+  printf("  --pty             "
+         "give the command a pseudo-terminal for stdout and stderr\n"
+         "                    so that it keeps line-buffering its output\n");
   printf("  -h, --help        print this help message\n");
   printf("  -v, --version     print version string\n");
   printf("  --debug           enable debugging\n");
   exit(rc);
 }
 
+// --stats: counters on how each of the command's streams flows through t3,
+// reported at exit and, on SIGUSR1, while it runs, to tell whether t3 or its
+// consumer holds things up. `blocked_ns` is kept by the stream's worker (or
+// reader thread), so the counters live in memory shared with the workers; the
+// rest are kept by the parent.
+struct stream_stats {
+  uint64_t blocked_ns;     // worker waiting for room in its message pipe
+  int max_queuelen;        // high-water marks of the parent's queue
+  size_t max_queued_bytes;
+};
+int show_stats = 0;
+struct stream_stats *stream_stats = NULL; // stdout, stderr
+static volatile sig_atomic_t stats_requested = 0;
+
+// Map the counters, before the workers are started.
+static void stats_init(void) {
+  stream_stats = mmap(NULL, 2 * sizeof(*stream_stats), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stream_stats == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  memset(stream_stats, 0, 2 * sizeof(*stream_stats));
+}
+
+static void stats_signal(int signum) {
+  (void)signum;
+  stats_requested = 1;
+}
+
+static uint64_t elapsed_ns(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000000u +
+         (uint64_t)now.tv_nsec - (uint64_t)since->tv_nsec;
+}
+
+// This worker's stream's `blocked_ns`, with --stats.
+static uint64_t *worker_blocked_ns = NULL;
+
+// write_full() to a non-blocking pipe, adding the time spent waiting for it
+// to have room to `*blocked_ns`.
+static int write_full_timed(int fd, const char *buf, size_t count,
+                            uint64_t *blocked_ns) {
+  while (count > 0) {
+    ssize_t written = write(fd, buf, count);
+    if (written >= 0) {
+      buf += written;
+      count -= (size_t)written;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN) {
+      return -1;
+    }
+    struct timespec since;
+    clock_gettime(CLOCK_MONOTONIC, &since);
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+      return -1;
+    }
+    __atomic_fetch_add(blocked_ns, elapsed_ns(&since), __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
 // Send one variable-length frame to the parent. `buf` has room for a
 // struct msg_header reserved at the front (filled in here) followed by `len`
 // bytes of line text, so the whole frame goes out in a single write_full()
 // call - one syscall and no extra copy. Each worker owns its message pipe, so
 // the single writer keeps frames from interleaving; write_full() keeps them
 // aligned across partial writes. A write error means the parent has gone
-// away, so there is nothing left to do but exit.
+// away, so there is nothing left to do but exit. `flags` is 0 or
+// MSG_CONTINUED, possibly with MSG_PARTIAL.
 void send_line(int pipe_fd, char *buf, size_t len,
-               const struct timespec *timestamp) {
+               const struct timespec *timestamp, uint32_t flags) {
   struct msg_header header;
   // Zero the whole struct first so its padding bytes are not sent as
   // uninitialized stack memory over the pipe.
   memset(&header, 0, sizeof(header));
   header.timestamp = *timestamp;
   header.length = (uint32_t)len;
+  header.flags = flags;
   memcpy(buf, &header, sizeof(header));
   _debug(1, "Sending %zu-byte line to parent process, timestamp: %ld.%09ld",
          len, timestamp->tv_sec, timestamp->tv_nsec);
-  if (write_full(pipe_fd, buf, sizeof(header) + len) == -1) {
+  int rc = worker_blocked_ns
+               ? write_full_timed(pipe_fd, buf, sizeof(header) + len,
+                                  worker_blocked_ns)
+               : write_full(pipe_fd, buf, sizeof(header) + len);
+  if (rc == -1) {
     perror("Error writing message to pipe");
     exit(EXIT_FAILURE);
   }
 }
 
-// Worker process body: read the raw output of the command from `fd`, split it
-// into lines, stamp each completed line with the time it was read, and forward
-// it to the parent over the message pipe `pipe_fd`. The message pipe is left in
-// its default blocking mode: if the parent falls behind, write_full() blocks
-// here, which in turn applies natural back-pressure to the command rather than
-// dropping or corrupting messages.
-void timestamp_and_send(int pipe_fd, int fd, const char *prefix) {
+// --cpus, --nice, --sched and --numa-local: where and how eagerly t3's own
+// processes and threads run, so that on a busy host its overhead stays out
+// of the way of the command it is measuring. They are applied by each worker
+// process or reader thread as it starts, and by the main thread once the
+// command has been spawned, so the command itself keeps the scheduling t3
+// was started with. On Linux, affinity, niceness and policy all belong to
+// the calling thread, which is why every thread applies them for itself.
+#ifdef CPU_SETSIZE
+static cpu_set_t sched_cpus;
+static int sched_cpus_set = 0;
+#endif
+static int sched_nice = 0;
+static int sched_policy = -1; // -1: leave the policy alone
+static int sched_numa_local = 0;
+
+// Parse a CPU list such as "0-3,8" into `set`. Returns 0, or -1 if invalid.
+#ifdef CPU_SETSIZE
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  for (;;) {
+    char *end;
+    errno = 0;
+    long first = strtol(p, &end, 10), last;
+    if (end == p || errno != 0 || first < 0) {
+      return -1;
+    }
+    last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || errno != 0 || last < first) {
+        return -1;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET((int)cpu, set);
+    }
+    if (*end == '\0') {
+      return 0;
+    }
+    if (*end != ',') {
+      return -1;
+    }
+    p = end + 1;
+  }
+}
+
+// The CPUs of the NUMA node t3 is running on, from sysfs. Returns 0, or -1 if
+// the node cannot be determined (e.g. no NUMA information is exposed).
+static int numa_local_cpus(cpu_set_t *set) {
+  int cpu = sched_getcpu();
+  if (cpu == -1) {
+    return -1;
+  }
+  for (int node = 0; node < CPU_SETSIZE; node++) {
+    char path[96], list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+      return -1; // nodes are numbered densely enough that a gap ends it
+    }
+    int ok = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+    list[strcspn(list, "\n")] = '\0';
+    if (ok && parse_cpu_list(list, set) == 0 && CPU_ISSET(cpu, set)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+#endif
+
+// Settle the CPU set once, before any worker starts: --numa-local narrows it
+// to the node t3 starts on (within --cpus, if also given).
+void sched_prepare(void) {
+#ifdef CPU_SETSIZE
+  cpu_set_t node;
+  if (sched_numa_local) {
+    if (numa_local_cpus(&node) != 0) {
+      _warn("--numa-local: cannot determine the local NUMA node");
+    } else if (!sched_cpus_set) {
+      sched_cpus = node;
+      sched_cpus_set = 1;
+    } else {
+      CPU_AND(&node, &node, &sched_cpus);
+      if (CPU_COUNT(&node) > 0) {
+        sched_cpus = node;
+      }
+    }
+  }
+#endif
+}
+
+// Apply the scheduling options to the calling thread. Failures are reported
+// but not fatal: t3 still works, only less politely.
+void sched_apply(const char *who) {
+#ifdef CPU_SETSIZE
+  if (sched_cpus_set &&
+      sched_setaffinity(0, sizeof(sched_cpus), &sched_cpus) == -1) {
+    _warn("cannot set the CPU affinity of the %s: %s", who, strerror(errno));
+  }
+#endif
+  if (sched_nice != 0) {
+    errno = 0;
+    int prio = getpriority(PRIO_PROCESS, 0);
+    if ((prio == -1 && errno != 0) ||
+        setpriority(PRIO_PROCESS, 0, prio + sched_nice) == -1) {
+      _warn("cannot set the niceness of the %s: %s", who, strerror(errno));
+    }
+  }
+#ifdef SCHED_BATCH
+  if (sched_policy != -1) {
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, sched_policy, &param) == -1) {
+      _warn("cannot set the scheduling policy of the %s: %s", who,
+            strerror(errno));
+    }
+  }
+#endif
+}
+
+// A single-producer, single-consumer queue of lines from a --threads reader
+// thread to the main thread. The two sides share only the head and tail
+// counters, each written by one side alone, so no lock is taken: the
+// release store publishing a slot pairs with the acquire load that reads it.
+// Lines are handed over as the payloads the main thread queues, with no
+// framing and no copy through a pipe. The reader writes a byte to the
+// `notify` pipe after each batch, so the main thread can sleep in poll()
+// until there is something to take; closing it marks the end of the stream.
+// The other way round, a reader facing a full ring raises `waiting` and
+// sleeps in read() on the `room` pipe, and the main thread writes a byte to
+// it after taking a line while `waiting` is up.
+#define SPSC_RING_SLOTS 4096
+
+struct spsc_ring {
+  size_t head; // next slot to take; written by the consumer only
+  size_t tail; // next slot to fill; written by the producer only
+  int waiting; // the producer is, or is about to be, asleep on `room`
+  int notify[2];
+  int room[2];
+  uint64_t *blocked_ns; // with --stats, the producer's time spent waiting
+  struct payload *slots[SPSC_RING_SLOTS];
+};
+
+// Producer side: append `msg_payload`, waiting while the ring is full (the
+// main thread has fallen behind, so back-pressure applies as with a pipe).
+// `waiting` is raised before the ring is checked again, and the consumer
+// checks it after freeing a slot, with a full fence on each side, so one of
+// the two always sees the other: either the ring has room after all, or a
+// wake-up is on its way. A wake-up left over from an earlier wait only makes
+// the loop check once more.
+static void spsc_push(struct spsc_ring *ring, struct payload *msg_payload) {
+  size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+      SPSC_RING_SLOTS) {
+    struct timespec since;
+    clock_gettime(CLOCK_MONOTONIC, &since);
+    for (;;) {
+      __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) !=
+          SPSC_RING_SLOTS) {
+        break;
+      }
+      char wakeups[64];
+      if (read(ring->room[0], wakeups, sizeof(wakeups)) == 0) {
+        break; // cannot happen while the ring exists; do not spin
+      }
+    }
+    if (ring->blocked_ns) {
+      __atomic_fetch_add(ring->blocked_ns, elapsed_ns(&since),
+                         __ATOMIC_RELAXED);
+    }
+  }
+  ring->slots[tail % SPSC_RING_SLOTS] = msg_payload;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Consumer side: take the oldest line, or NULL if the ring is empty.
+static struct payload *spsc_pop(struct spsc_ring *ring) {
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  struct payload *msg_payload = ring->slots[head % SPSC_RING_SLOTS];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED)) {
+    write_full(ring->room[1], "", 1);
+  }
+  return msg_payload;
+}
+
+// Where split_lines() hands each completed line, or piece of a long one:
+// `buf` holds a struct msg_header's worth of reserved space followed by `len`
+// bytes of text, and `flags` is MSG_CONTINUED if more of the line follows
+// (with MSG_PARTIAL if it was forwarded for --partial-flush).
+typedef void (*line_handler)(void *ctx, char *buf, size_t len,
+                             const struct timespec *timestamp,
+                             uint32_t flags);
+
+// --partial-flush: how long (in milliseconds) part of a line may wait for its
+// newline before it is forwarded anyway, or 0 to wait for as long as it takes.
+// A prompt or a progress bar redrawn with '\r' then shows up while the
+// command is still at it, rather than when the line is finally ended.
+long partial_flush_ms = 0;
+
+// Read the raw output of the command from `fd`, split it into lines, and pass
+// each completed line, stamped with the time it was read, to `handle`.
+// `batch_done`, if given, is called after each read's lines are handled.
+static void split_lines(int fd, line_handler handle, void (*batch_done)(void *),
+                        void *ctx) {
   char buffer[BUFFER_SIZE];
   ssize_t bytes_read;
 
-  // TODO: set argv[0] to incorporate prefix
-
   // Line-assembly buffer: a struct msg_header is reserved at the front and the
   // line text accumulates after it, so a completed line is sent with a single
-  // write (see send_line). The buffer grows as needed up to MAX_FRAME_SIZE,
-  // i.e. enough to hold the header plus a full MAX_LINE_SIZE bytes of text.
+  // write (see send_line). The buffer is reserved with room for the header
+  // plus LINE_CHUNK_SIZE bytes of text, and only as much of it as the longest
+  // line so far is ever backed by memory (see vbuf_reserve).
   const size_t header_size = sizeof(struct msg_header);
-  size_t capacity = BUFFER_SIZE;
-  char *line = xmalloc(capacity);
+  const size_t capacity = header_size + LINE_CHUNK_SIZE;
+  char *line = vbuf_reserve(capacity);
   size_t line_length = 0; // text bytes accumulated (excludes the header)
   struct timespec timestamp = {0, 0};
+  int line_open = 0; // pieces of the current line have been forwarded
+  int pending = 0; // whether `pending_since` holds for the text accumulated
+  struct timespec pending_since = {0, 0}; // when its oldest byte was read
 
-  // Send a zero-timestamped "<prefix> started" frame so the parent can confirm
-  // the worker is online and the message pipe is wired up correctly.
-  int started = snprintf(line + header_size, capacity - header_size,
-                         "%s started", prefix);
-  if (started < 0 || (size_t)started >= capacity - header_size) {
-    _error("Message truncated in timestamp_and_send");
-    exit(EXIT_FAILURE);
-  }
-  send_line(pipe_fd, line, (size_t)started, &timestamp);
-
-  while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+  for (;;) {
+    // With --partial-flush, wait for more only until the text accumulated is
+    // partial_flush_ms old, then forward it as a piece of the line.
+    if (partial_flush_ms > 0 && line_length > 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      long waited = (now.tv_sec - pending_since.tv_sec) * 1000 +
+                    (now.tv_nsec - pending_since.tv_nsec) / 1000000;
+      struct pollfd pfd = {fd, POLLIN, 0};
+      int ready = waited < partial_flush_ms
+                      ? poll(&pfd, 1, (int)(partial_flush_ms - waited))
+                      : 0;
+      if (ready == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ready == 0) {
+        handle(ctx, line, line_length, &timestamp,
+               MSG_CONTINUED | MSG_PARTIAL);
+        line_length = 0;
+        line_open = 1;
+        pending = 0;
+        if (batch_done) {
+          batch_done(ctx);
+        }
+        continue;
+      }
+    }
+    if ((bytes_read = read(fd, buffer, sizeof(buffer))) <= 0) {
+      break;
+    }
     // Get the current time with nanosecond precision. Note that if a
     // line is split across multiple reads, the timestamp will be set
     // to the time that the _last_ read is completed.
@@ -359,40 +972,153 @@ void timestamp_and_send(int pipe_fd, int fd, const char *prefix) {
 
     for (ssize_t i = 0; i < bytes_read; i++) {
       if (buffer[i] == '\n') {
-        send_line(pipe_fd, line, line_length, &timestamp);
+        handle(ctx, line, line_length, &timestamp, 0);
         line_length = 0; // Reset for the next line
+        line_open = 0;
+        pending = 0;
         continue;
       }
-      // Ensure room for one more text byte, growing the buffer up to
-      // MAX_FRAME_SIZE (header + MAX_LINE_SIZE bytes of text). A line whose
-      // text reaches the MAX_LINE_SIZE cap is flushed in pieces rather than
-      // truncated.
+      // A line longer than LINE_CHUNK_SIZE is streamed on in pieces rather
+      // than held in full (or truncated).
       if (header_size + line_length + 1 > capacity) {
-        if (capacity >= MAX_FRAME_SIZE) {
-          send_line(pipe_fd, line, line_length, &timestamp);
-          line_length = 0;
-        } else {
-          capacity *= 2;
-          if (capacity > MAX_FRAME_SIZE) {
-            capacity = MAX_FRAME_SIZE;
-          }
-          line = xrealloc(line, capacity);
-        }
+        handle(ctx, line, line_length, &timestamp, MSG_CONTINUED);
+        line_length = 0;
+        line_open = 1;
+        pending = 0;
       }
       line[header_size + line_length++] = buffer[i];
     }
+    if (line_length > 0 && !pending) {
+      pending_since = timestamp;
+      pending = 1;
+    }
+    if (batch_done) {
+      batch_done(ctx);
+    }
   }
 
-  if (bytes_read < 0) {
+  // Reading a pty master (--pty) fails with EIO once the command and all of
+  // its descendants have closed the slave: that is the pty's end-of-file.
+  if (bytes_read < 0 && errno != EIO) {
     fprintf(stderr, "Error reading file descriptor: %s\n", strerror(errno));
   }
 
-  // Handle any remaining data in the buffer that doesn't end with a newline
-  if (line_length > 0) {
-    send_line(pipe_fd, line, line_length, &timestamp);
+  // Handle any remaining data in the buffer that doesn't end with a newline,
+  // or end a line whose text has all been forwarded by --partial-flush.
+  if (line_length > 0 || line_open) {
+    handle(ctx, line, line_length, &timestamp, 0);
+    if (batch_done) {
+      batch_done(ctx);
+    }
+  }
+
+  vbuf_release(line, capacity);
+}
+
+static void send_line_handler(void *ctx, char *buf, size_t len,
+                              const struct timespec *timestamp,
+                              uint32_t flags) {
+  send_line(*(int *)ctx, buf, len, timestamp, flags);
+}
+
+// Worker process body: split the command's output on `fd` into lines (see
+// split_lines) and forward each to the parent over the message pipe
+// `pipe_fd`. The message pipe is left in its default blocking mode: if the
+// parent falls behind, write_full() blocks here, which in turn applies
+// natural back-pressure to the command rather than dropping or corrupting
+// messages.
+void timestamp_and_send(int pipe_fd, int fd, const char *prefix) {
+  // TODO: set argv[0] to incorporate prefix
+
+  // Send a zero-timestamped "<prefix> started" frame so the parent can confirm
+  // the worker is online and the message pipe is wired up correctly.
+  char frame[sizeof(struct msg_header) + 64];
+  const size_t header_size = sizeof(struct msg_header);
+  struct timespec timestamp = {0, 0};
+  int started = snprintf(frame + header_size, sizeof(frame) - header_size,
+                         "%s started", prefix);
+  if (started < 0 || (size_t)started >= sizeof(frame) - header_size) {
+    _error("Message truncated in timestamp_and_send");
+    exit(EXIT_FAILURE);
+  }
+  send_line(pipe_fd, frame, (size_t)started, &timestamp, 0);
+
+  // With --stats, time spent waiting on a full message pipe is measured by
+  // making it non-blocking and timing the wait for room whenever a write
+  // would block, which costs nothing while the pipe has room.
+  if (stream_stats && fcntl(pipe_fd, F_SETFL, O_NONBLOCK) == 0) {
+    worker_blocked_ns = &stream_stats[strcmp(prefix, "stderr") == 0].blocked_ns;
+  }
+  split_lines(fd, send_line_handler, NULL, &pipe_fd);
+}
+
+// --threads: a reader thread stands in for a worker process, in the same
+// address space, so a line reaches the main thread through a spsc_ring
+// rather than being framed, written to a pipe and read back. There is no
+// handshake, as there is no pipe to check.
+struct reader_thread {
+  pthread_t thread;
+  int fd; // the command's stdout or stderr
+  struct spsc_ring ring;
+  int batched; // lines pushed since the last notification
+};
+
+static void ring_line_handler(void *ctx, char *buf, size_t len,
+                              const struct timespec *timestamp,
+                              uint32_t flags) {
+  struct reader_thread *rt = ctx;
+  struct payload *msg_payload = xmalloc(sizeof(*msg_payload) + len + 1);
+  msg_payload->timestamp = *timestamp;
+  msg_payload->length = (uint32_t)len;
+  msg_payload->flags = flags;
+  memcpy(msg_payload->text, buf + sizeof(struct msg_header), len);
+  msg_payload->text[len] = '\0';
+  spsc_push(&rt->ring, msg_payload);
+  rt->batched = 1;
+}
+
+// Wake the main thread for the lines just pushed. Should it have gone away
+// (the pipe's read end is closed on a fatal output error), there is no one
+// left to wake; the thread carries on until the process exits.
+static void ring_batch_done(void *ctx) {
+  struct reader_thread *rt = ctx;
+  if (rt->batched) {
+    rt->batched = 0;
+    write_full(rt->ring.notify[1], "", 1);
   }
+}
+
+static void *reader_thread_main(void *arg) {
+  struct reader_thread *rt = arg;
+  // SIGUSR1 (--stats) is for the main thread; here it would cut a read short.
+  sigset_t stats_signals;
+  sigemptyset(&stats_signals);
+  sigaddset(&stats_signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+  sched_apply("reader thread");
+  split_lines(rt->fd, ring_line_handler, ring_batch_done, rt);
+  close(rt->fd);
+  close(rt->ring.notify[1]);
+  return NULL;
+}
 
-  free(line);
+// Start a reader thread on `fd`, using `notify`, a pipe, to wake the main
+// thread, and counting its time waiting on a full ring in `blocked_ns` (or
+// not, if NULL). Returns 0, or an error number on failure.
+int reader_thread_start(struct reader_thread *rt, int fd, int notify[2],
+                        uint64_t *blocked_ns) {
+  memset(rt, 0, sizeof(*rt));
+  rt->fd = fd;
+  rt->ring.notify[0] = notify[0];
+  rt->ring.notify[1] = notify[1];
+  rt->ring.blocked_ns = blocked_ns;
+  if (fcntl(notify[0], F_SETFL, O_NONBLOCK) == -1 ||
+      pipe(rt->ring.room) == -1 ||
+      fcntl(rt->ring.room[0], F_SETFD, FD_CLOEXEC) == -1 ||
+      fcntl(rt->ring.room[1], F_SETFD, FD_CLOEXEC) == -1) {
+    return errno;
+  }
+  return pthread_create(&rt->thread, NULL, reader_thread_main, rt);
 }
 
 int timespec_cmp(const struct timespec *a, const struct timespec *b) {
@@ -413,7 +1139,7 @@ long timespec_ms_delta(const struct timespec *a, const struct timespec *b) {
 
 // Function to add a message to the end of a queue
 void push(struct message **head, struct message **tail, struct message *msg,
-          int *queuelen) {
+          int *queuelen, size_t *queued_bytes) {
   msg->next = NULL;
   if (*tail == NULL) {
     *tail = *head = msg;
@@ -422,10 +1148,12 @@ void push(struct message **head, struct message **tail, struct message *msg,
     *tail = msg;
   }
   (*queuelen)++;
+  *queued_bytes += msg->msg_payload->length;
 }
 
 // Function to remove the message from the front of the queue
-void shift(struct message **head, struct message **tail, int *queuelen) {
+void shift(struct message **head, struct message **tail, int *queuelen,
+           size_t *queued_bytes) {
   if (*head == NULL) {
     return;
   }
@@ -437,74 +1165,52 @@ void shift(struct message **head, struct message **tail, int *queuelen) {
     *tail = NULL;
   }
   (*queuelen)--;
+  *queued_bytes -= msg_to_free->msg_payload->length;
   // Free all memory associated with the deleted message
   free(msg_to_free->msg_payload);
   free(msg_to_free);
 }
 
-// Read and validate a worker's startup handshake: a zero-timestamped
-// "<prefix> started" frame. Returns 0 on success, -1 on any I/O error or
-// mismatch (a diagnostic is printed in the mismatch case).
-int await_worker(int fd, const char *prefix) {
-  struct msg_header header;
-  char text[64];
-  char expected[64];
-
-  int rc = read_full(fd, &header, sizeof(header));
-  if (rc != 1) {
-    // read_full signals a real read error with errno set, and a clean EOF or a
-    // truncated frame with errno == 0; only perror() in the former case so we
-    // never print a misleading "Success".
-    if (rc < 0 && errno != 0) {
-      perror("Error reading worker handshake");
-    } else {
-      fprintf(stderr, "Error: %s worker closed before completing handshake\n",
-              prefix);
-    }
-    return -1;
-  }
-  if (header.length >= sizeof(text) ||
-      read_full(fd, text, header.length) != 1) {
-    fprintf(stderr, "Error: malformed handshake from %s worker\n", prefix);
-    return -1;
-  }
-  text[header.length] = '\0';
-  snprintf(expected, sizeof(expected), "%s started", prefix);
-  if (header.timestamp.tv_sec != 0 || header.timestamp.tv_nsec != 0 ||
-      strcmp(text, expected) != 0) {
-    fprintf(stderr, "Error: Unexpected message from %s worker: %s\n", prefix,
-            text);
-    return -1;
-  }
-  return 0;
-}
-
 // A buffered reader over a worker's message pipe. Rather than issuing a
 // separate read() for each frame's header and body, it pulls a large chunk
 // per syscall into `buf` and parses as many whole frames as that chunk
 // contains, so the per-line syscall cost is amortized across many lines.
 // Unconsumed bytes live in buf[start:end]; a partial frame is simply carried
 // over to the next read.
+//
+// The first frame on each pipe is the worker's zero-timestamped "<prefix>
+// started" handshake. Rather than block on it before launching the command,
+// the reader validates it lazily as the first frame to arrive, and consumes
+// it without passing it on.
+//
+// With --threads the reader takes lines from a reader thread's spsc_ring
+// instead, and `fd` is the ring's notification pipe: a fill consumes the
+// wake-ups and the lines themselves come straight off the ring.
 struct framereader {
   int fd;
-  char *buf;
-  size_t cap;
-  size_t start; // offset of the first unconsumed byte
-  size_t end;   // offset just past the last valid byte
+  struct spsc_ring *ring;
+  char *buf;             // MAX_FRAME_SIZE reserved (see vbuf_reserve)
+  size_t start;          // offset of the first unconsumed byte
+  size_t end;            // offset just past the last valid byte
+  const char *handshake; // worker prefix while its handshake is still due
 };
 
-#define FRAMEREADER_INITIAL_CAP (64 * 1024)
-
-void framereader_init(struct framereader *fr, int fd) {
+void framereader_init(struct framereader *fr, int fd, const char *prefix) {
   fr->fd = fd;
-  fr->cap = FRAMEREADER_INITIAL_CAP;
-  fr->buf = xmalloc(fr->cap);
+  fr->ring = NULL;
+  fr->handshake = prefix;
+  fr->buf = vbuf_reserve(MAX_FRAME_SIZE);
   fr->start = 0;
   fr->end = 0;
 }
 
+void framereader_init_ring(struct framereader *fr, struct spsc_ring *ring) {
+  framereader_init(fr, ring->notify[0], NULL);
+  fr->ring = ring;
+}
+
 void framereader_free(struct framereader *fr) {
-  free(fr->buf);
+  vbuf_release(fr->buf, MAX_FRAME_SIZE);
   fr->buf = NULL;
 }
 
@@ -515,10 +1221,20 @@ size_t framereader_pending(const struct framereader *fr) {
 }
 
 // Issue a single read() into the buffer, making room first by compacting
-// consumed bytes and, if a frame larger than the buffer is being assembled,
-// growing it. Returns 1 if bytes were read, 0 at end-of-file, -1 on error
+// consumed bytes. Returns 1 if bytes were read, 0 at end-of-file, -1 on error
 // (errno set). Reads exactly once so it never blocks after a POLLIN.
 int framereader_fill(struct framereader *fr) {
+  if (fr->ring) {
+    char wakeups[256]; // the lines themselves are on the ring
+    ssize_t n;
+    do {
+      n = read(fr->fd, wakeups, sizeof(wakeups));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EAGAIN) {
+      return 1;
+    }
+    return n < 0 ? -1 : n > 0;
+  }
   if (fr->start > 0) {
     // Reclaim space consumed from the front.
     size_t remaining = fr->end - fr->start;
@@ -526,25 +1242,18 @@ int framereader_fill(struct framereader *fr) {
     fr->start = 0;
     fr->end = remaining;
   }
-  if (fr->end == fr->cap) {
-    // Buffer full of one not-yet-complete frame: double it to make room, but
-    // never past MAX_FRAME_SIZE. A complete frame always fits within that
-    // bound (framereader_next() rejects any frame claiming a larger body), so
-    // a buffer that is full at the cap means the stream is corrupt.
-    if (fr->cap >= MAX_FRAME_SIZE) {
-      fprintf(stderr, "Error: frame exceeds maximum size %zu; aborting\n",
-              (size_t)MAX_FRAME_SIZE);
-      exit(EXIT_FAILURE);
-    }
-    fr->cap *= 2;
-    if (fr->cap > MAX_FRAME_SIZE) {
-      fr->cap = MAX_FRAME_SIZE;
-    }
-    fr->buf = xrealloc(fr->buf, fr->cap);
+  if (fr->end == MAX_FRAME_SIZE) {
+    // Buffer full of one not-yet-complete frame. A complete frame always fits
+    // (framereader_next() rejects any frame claiming a larger body), so the
+    // stream is corrupt.
+    fprintf(stderr, "Error: frame exceeds maximum size %zu; aborting\n",
+            (size_t)MAX_FRAME_SIZE);
+    worker_failed = 1;
+    return 0;
   }
   ssize_t n;
   do {
-    n = read(fr->fd, fr->buf + fr->end, fr->cap - fr->end);
+    n = read(fr->fd, fr->buf + fr->end, MAX_FRAME_SIZE - fr->end);
   } while (n < 0 && errno == EINTR);
   if (n < 0) {
     return -1;
@@ -556,11 +1265,36 @@ int framereader_fill(struct framereader *fr) {
   return 1;
 }
 
+// Check a worker's handshake frame, which must be zero-timestamped and read
+// "<prefix> started". A mismatch means the message pipe is not carrying what
+// the worker sent, so nothing after it can be trusted: fail fast, setting
+// worker_failed. Returns 0 if the handshake is good, -1 if not.
+static int framereader_check_handshake(const struct framereader *fr,
+                                       const struct payload *msg_payload) {
+  char expected[64];
+  snprintf(expected, sizeof(expected), "%s started", fr->handshake);
+  if (msg_payload->timestamp.tv_sec != 0 ||
+      msg_payload->timestamp.tv_nsec != 0 ||
+      strcmp(msg_payload->text, expected) != 0) {
+    fprintf(stderr, "Error: Unexpected message from %s worker: %s\n",
+            fr->handshake, msg_payload->text);
+    worker_failed = 1;
+    return -1;
+  }
+  _debug(2, "confirmed %s worker is online and ready", fr->handshake);
+  return 0;
+}
+
 // Parse the next whole frame out of the buffer, if one is fully present.
 // Returns a freshly allocated payload (caller frees) or NULL when more bytes
-// are needed. memcpy is used for the header because buffered bytes are not
-// suitably aligned for a struct access.
+// are needed, or when the stream turns out to be corrupt (see worker_failed).
+// memcpy is used for the header because buffered bytes are not suitably
+// aligned for a struct access. The handshake frame is validated and swallowed
+// here, so callers only ever see the command's lines.
 struct payload *framereader_next(struct framereader *fr) {
+  if (fr->ring) {
+    return spsc_pop(fr->ring);
+  }
   size_t available = fr->end - fr->start;
   if (available < sizeof(struct msg_header)) {
     return NULL;
@@ -573,7 +1307,8 @@ struct payload *framereader_next(struct framereader *fr) {
     // Fail fast rather than attempt a huge allocation / unbounded growth.
     fprintf(stderr, "Error: frame length %u exceeds maximum %d; aborting\n",
             header.length, MAX_LINE_SIZE);
-    exit(EXIT_FAILURE);
+    worker_failed = 1;
+    return NULL;
   }
   if (available < sizeof(header) + header.length) {
     return NULL; // body not fully buffered yet
@@ -582,35 +1317,151 @@ struct payload *framereader_next(struct framereader *fr) {
       xmalloc(sizeof(*msg_payload) + header.length + 1);
   msg_payload->timestamp = header.timestamp;
   msg_payload->length = header.length;
+  msg_payload->flags = header.flags & (MSG_CONTINUED | MSG_PARTIAL);
   memcpy(msg_payload->text, fr->buf + fr->start + sizeof(header),
          header.length);
   msg_payload->text[header.length] = '\0';
   fr->start += sizeof(header) + header.length;
+  if (fr->handshake) {
+    int rc = framereader_check_handshake(fr, msg_payload);
+    fr->handshake = NULL;
+    free(msg_payload);
+    return rc == 0 ? framereader_next(fr) : NULL;
+  }
   return msg_payload;
 }
 
-// React to a failed write on one of t3's outputs according to the configured
-// --output-error mode. `err` is the errno captured at the point of failure
-// (passed in so intervening libc calls cannot clobber it). Marks the sink
-// broken so the caller stops writing to it. For a fatal mode it sets
-// output_error_fatal rather than calling exit() directly, so the caller's
-// drain loop can break to the shared teardown (closing the logfile and
-// reaping children) before exiting with failure status.
-static void output_write_error(const char *sink, int *broken, int err) {
-  int is_pipe = (err == EPIPE);
-  if (broken) {
-    *broken = 1;
+// Parser state for removing ANSI/ECMA-48 escape sequences from a stream of
+// text: CSI sequences (ESC [ ... final), OSC and the other string controls
+// (ESC ] / P / X / ^ / _ ... terminated by BEL or by ESC \), and two-byte
+// escapes. The state survives between calls, so a sequence split across two
+// pieces of the same stream is still recognized; each stream needs its own
+// stripper.
+enum ansi_state {
+  ANSI_GROUND,     // ordinary text
+  ANSI_ESC,        // just saw ESC
+  ANSI_ESC_INTER,  // ESC followed by intermediate bytes
+  ANSI_CSI,        // inside a control sequence
+  ANSI_STRING,     // inside OSC/DCS/SOS/PM/APC text
+  ANSI_STRING_ESC, // ESC inside a string: possibly its terminator
+};
+
+struct ansi_stripper {
+  enum ansi_state state;
+  char *buf; // holds the stripped copy when one is needed
+  size_t cap;
+};
+
+struct ansi_stripper stdout_stripper = {ANSI_GROUND, NULL, 0};
+struct ansi_stripper stderr_stripper = {ANSI_GROUND, NULL, 0};
+
+// Return `text` with escape sequences removed, and its new length in
+// *out_len. The common case of a line with no ESC byte and no sequence left
+// open is found with a single memchr() - which C libraries implement with
+// vector instructions - and returns `text` itself without copying. Otherwise
+// the result is a NUL-terminated copy owned by the stripper, valid until its
+// next call.
+const char *ansi_strip(struct ansi_stripper *st, const char *text, size_t len,
+                       size_t *out_len) {
+  const char *esc = memchr(text, '\x1b', len);
+  if (st->state == ANSI_GROUND && esc == NULL) {
+    *out_len = len;
+    return text;
   }
-  // Each case returns rather than breaks: that keeps a default: out of the
-  // switch (so -Wall's -Wswitch still warns at compile time if a new mode is
-  // added but not handled here) while letting the abort() below act as a
-  // runtime guard. The abort() is unreachable in normal operation - the modes
-  // are validated when --output-error is parsed - but if a corrupted value
-  // ever reaches here we fail loudly instead of silently doing nothing, which
-  // a human is far less likely to miss than a compiler warning.
-  switch (output_error) {
-  case OUTPUT_ERROR_DEFAULT:
-    // tee's default: fatal on a pipe error, diagnose the rest.
+  if (st->cap < len + 1) {
+    st->cap = len + 1;
+    st->buf = xrealloc(st->buf, st->cap);
+  }
+  size_t n = 0;
+  size_t i = 0;
+  if (st->state == ANSI_GROUND) {
+    // Everything before the first ESC is plain text.
+    n = i = (size_t)(esc - text);
+    memcpy(st->buf, text, n);
+  }
+  for (; i < len; i++) {
+    unsigned char c = (unsigned char)text[i];
+    switch (st->state) {
+    case ANSI_GROUND:
+      if (c == 0x1b) {
+        st->state = ANSI_ESC;
+      } else {
+        st->buf[n++] = (char)c;
+      }
+      break;
+    case ANSI_ESC:
+      if (c == '[') {
+        st->state = ANSI_CSI;
+      } else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+        st->state = ANSI_STRING;
+      } else if (c >= 0x20 && c <= 0x2f) {
+        st->state = ANSI_ESC_INTER;
+      } else if (c == 0x1b) {
+        // ESC ESC: the first one was stray; stay in ANSI_ESC.
+      } else {
+        st->state = ANSI_GROUND; // two-byte escape, e.g. ESC 7 or ESC =
+      }
+      break;
+    case ANSI_ESC_INTER:
+      if (c < 0x20 || c > 0x2f) {
+        st->state = ANSI_GROUND;
+      }
+      break;
+    case ANSI_CSI:
+      if (c >= 0x40 && c <= 0x7e) {
+        st->state = ANSI_GROUND;
+      } else if (c < 0x20) {
+        // A control byte cannot occur in a CSI sequence: abandon it and keep
+        // the byte as text.
+        st->state = (c == 0x1b) ? ANSI_ESC : ANSI_GROUND;
+        if (c != 0x1b) {
+          st->buf[n++] = (char)c;
+        }
+      }
+      break;
+    case ANSI_STRING:
+      if (c == 0x07) {
+        st->state = ANSI_GROUND;
+      } else if (c == 0x1b) {
+        st->state = ANSI_STRING_ESC;
+      }
+      break;
+    case ANSI_STRING_ESC:
+      if (c == '\\') {
+        st->state = ANSI_GROUND;
+      } else if (c != 0x1b) {
+        st->state = ANSI_STRING;
+      }
+      break;
+    }
+  }
+  st->buf[n] = '\0';
+  *out_len = n;
+  return st->buf;
+}
+
+// React to a failed write on one of t3's outputs according to the configured
+// --output-error mode. `err` is the errno captured at the point of failure
+// (passed in so intervening libc calls cannot clobber it). Marks the sink
+// broken so the caller stops writing to it. For a fatal mode it sets
+// output_error_fatal rather than calling exit() directly, so the caller's
+// drain loop can break to the shared teardown (closing the logfile and
+// reaping children) before exiting with failure status.
+static void output_write_error(const char *sink, int *broken, int err) {
+  int is_pipe = (err == EPIPE);
+  if (broken) {
+    *broken = 1;
+  }
+  // Each case returns rather than breaks: that keeps a default: out of the
+  // switch (so -Wall's -Wswitch still warns at compile time if a new mode is
+  // added but not handled here) while letting the abort() below act as a
+  // runtime guard. The abort() is unreachable in normal operation - the modes
+  // are validated when --output-error is parsed - but if a corrupted value
+  // ever reaches here we fail loudly instead of silently doing nothing, which
+  // a human is far less likely to miss than a compiler warning.
+  switch (output_error) {
+  case OUTPUT_ERROR_DEFAULT:
+    // tee's default: fatal on a pipe error, diagnose the rest.
     if (is_pipe) {
       output_error_fatal = 1;
     } else {
@@ -629,107 +1480,2358 @@ static void output_write_error(const char *sink, int *broken, int err) {
     _error("write error on %s: %s", sink, strerror(err));
     output_error_fatal = 1;
     return;
-  case OUTPUT_ERROR_EXIT_NOPIPE:
-    if (!is_pipe) {
-      _error("write error on %s: %s", sink, strerror(err));
-      output_error_fatal = 1;
+  case OUTPUT_ERROR_EXIT_NOPIPE:
+    if (!is_pipe) {
+      _error("write error on %s: %s", sink, strerror(err));
+      output_error_fatal = 1;
+    }
+    return;
+  }
+  _error("internal error: unhandled output_error mode %d", output_error);
+  abort();
+}
+
+// JSON string escapes, indexed by byte: 0 for a byte that is copied as is,
+// otherwise the character after the backslash ('u' meaning \u00XX). Bytes of
+// 0x80 and up pass through, so valid UTF-8 stays valid; t3 does not repair
+// invalid UTF-8 from the command.
+static const char json_escapes[256] = {
+    [0x00 ... 0x07] = 'u', ['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n',
+    [0x0b] = 'u',          ['\f'] = 'f', ['\r'] = 'r', [0x0e ... 0x1f] = 'u',
+    ['"'] = '"',           ['\\'] = '\\',
+};
+
+// Append `len` bytes of `text` to `sb` escaped as the inside of a JSON
+// string, so that a line sent in pieces can be escaped piece by piece. Rather
+// than deciding byte by byte what to emit, the table lookup finds the end of
+// each run of bytes needing no escape and the run is copied in one go.
+static void json_append_escaped(struct strbuf *sb, const char *text,
+                                size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *bytes = (const unsigned char *)text;
+  size_t run = 0;
+  for (size_t i = 0; i < len; i++) {
+    char escape = json_escapes[bytes[i]];
+    if (escape == 0) {
+      continue;
+    }
+    strbuf_append(sb, text + run, i - run);
+    run = i + 1;
+    if (escape == 'u') {
+      char seq[6] = {'\\', 'u', '0', '0', hex[bytes[i] >> 4],
+                     hex[bytes[i] & 0xf]};
+      strbuf_append(sb, seq, sizeof(seq));
+    } else {
+      char seq[2] = {'\\', escape};
+      strbuf_append(sb, seq, sizeof(seq));
+    }
+  }
+  strbuf_append(sb, text + run, len - run);
+}
+
+// Everything the renditions of one line are built from. The timestamp prefix
+// and the ANSI-stripped text are worked out once per line, however many
+// sinks use them. A line that arrives in pieces (see MSG_CONTINUED) is
+// rendered piece by piece: only its first piece `starts` it, with the
+// timestamp and color, and only its last `ends` it.
+struct line {
+  int starts, ends;
+  const struct timespec *stamp;
+  const char *stream_name;
+  const char *color;
+  const char *timestamp; // rendered timestamp prefix, or ""
+  const char *text[2];   // [0] as received, [1] with ANSI escapes removed
+  size_t length[2];
+};
+
+// Render `ln` as one record in `format`, from its raw or stripped text,
+// replacing the contents of `sb`. A --log-format=jsonl record looks like
+//   {"ts":1700000000.123456789,"stream":"stdout","text":"hi"}
+// where ts is the line's timestamp in seconds since the epoch, to the
+// nanosecond. A reader that parses it as a double keeps only about a quarter
+// of a microsecond of that; the digits are there for one that does not.
+static void render_line(struct strbuf *sb, const struct line *ln,
+                        enum log_format format, int stripped) {
+  const char *text = ln->text[stripped];
+  size_t len = ln->length[stripped];
+  sb->len = 0;
+  switch (format) {
+  case LOG_FORMAT_TEXT:
+    if (ln->starts) {
+      strbuf_puts(sb, ts_color);
+      strbuf_puts(sb, ln->timestamp);
+      strbuf_puts(sb, reset_color);
+      strbuf_puts(sb, ln->color);
+    }
+    strbuf_append(sb, text, len);
+    if (ln->ends) {
+      strbuf_puts(sb, reset_color);
+      strbuf_append(sb, "\n", 1);
+    }
+    return;
+  case LOG_FORMAT_PLAIN:
+    if (ln->starts) {
+      strbuf_puts(sb, ln->timestamp);
+    }
+    strbuf_append(sb, text, len);
+    if (ln->ends) {
+      strbuf_append(sb, "\n", 1);
+    }
+    return;
+  case LOG_FORMAT_JSONL: {
+    if (ln->starts) {
+      char prefix[100];
+      int n = snprintf(prefix, sizeof(prefix),
+                       "{\"ts\":%lld.%09ld,\"stream\":\"%s\",\"text\":\"",
+                       (long long)ln->stamp->tv_sec, ln->stamp->tv_nsec,
+                       ln->stream_name);
+      strbuf_append(sb, prefix, (size_t)n);
+    }
+    json_append_escaped(sb, text, len);
+    if (ln->ends) {
+      strbuf_append(sb, "\"}\n", 3);
+    }
+    return;
+  }
+  }
+}
+
+// Renditions of the current line, indexed by format and by whether the text
+// is ANSI-stripped. Each is rendered on first use and then shared by every
+// sink that wants it; `serial` records which line it was rendered for.
+struct rendition {
+  struct strbuf sb;
+  unsigned long serial;
+};
+static struct rendition renditions[LOG_FORMAT_COUNT][2];
+static unsigned long line_serial = 0;
+
+static const struct strbuf *line_rendition(const struct line *ln,
+                                           enum log_format format,
+                                           int stripped) {
+  struct rendition *r = &renditions[format][stripped];
+  if (r->serial != line_serial) {
+    render_line(&r->sb, ln, format, stripped);
+    r->serial = line_serial;
+  }
+  return &r->sb;
+}
+
+// --ring: a "flight recorder" log file of fixed size holding only the most
+// recent records. The file is a header followed by a data area used as a
+// circular buffer; it is preallocated up front and mapped into memory, so a
+// record is a memcpy() into the page cache - no write(2), no stdio buffer -
+// and whatever t3 has logged survives t3 itself crashing. `head` is advanced
+// only after the record's bytes are in place. --ring-read prints the records
+// back oldest first.
+#define RING_MAGIC "t3ring2\n"
+
+struct ring_header {
+  char magic[8];
+  uint64_t size;    // bytes in the data area that follows the header
+  uint64_t head;    // offset in the data area of the next byte to write
+  uint64_t wrapped; // nonzero once writing has wrapped around to the start
+  uint64_t cut;     // nonzero if the oldest byte, at `head`, is mid-line
+};
+
+static char *ring_data(struct ring_header *ring) {
+  return (char *)(ring + 1);
+}
+
+// Create (or, with `append`, reopen) the ring file of `sink` and map it.
+// Returns 0 on success, -1 with errno set on failure. With `append`, a file
+// that holds anything but a ring of this size is left alone and reported,
+// returning -2: --append is there to keep the records.
+int ring_open(struct log_sink *sink, int append) {
+  size_t total = sizeof(struct ring_header) + (size_t)sink->ring_size;
+  int fd = open(sink->path, O_RDWR | O_CREAT, 0666);
+  if (fd == -1) {
+    return -1;
+  }
+  struct ring_header *ring = NULL;
+  struct stat st;
+  int reuse = 0;
+  if (fstat(fd, &st) == 0 && append && (size_t)st.st_size == total) {
+    ring = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    reuse = ring != MAP_FAILED &&
+            memcmp(ring->magic, RING_MAGIC, sizeof(ring->magic)) == 0 &&
+            ring->size == (uint64_t)sink->ring_size &&
+            ring->head < ring->size;
+    if (!reuse && ring != MAP_FAILED) {
+      munmap(ring, total);
+    }
+  }
+  if (!reuse && append && st.st_size != 0) {
+    fprintf(stderr,
+            "Error: '%s' is not a t3 ring file of --ring=%lld bytes; "
+            "not overwriting it with --append\n",
+            sink->path, (long long)sink->ring_size);
+    close(fd);
+    return -2;
+  }
+  if (!reuse) {
+    int err = 0;
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t)total) == -1) {
+      err = errno;
+    }
+#ifndef __APPLE__
+    // Reserve the blocks now so the data area cannot hit ENOSPC later, which
+    // through a mapping would arrive as SIGBUS rather than a write error.
+    if (err == 0) {
+      err = posix_fallocate(fd, 0, (off_t)total);
+    }
+#endif
+    ring = err ? MAP_FAILED
+               : mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+      err = err ? err : errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    memcpy(ring->magic, RING_MAGIC, sizeof(ring->magic));
+    ring->size = (uint64_t)sink->ring_size;
+    ring->head = 0;
+    ring->wrapped = 0;
+    ring->cut = 0;
+  }
+  close(fd); // the mapping keeps the file open
+  sink->ring = ring;
+  return 0;
+}
+
+// Append a record to the ring, overwriting the oldest data. Of a record
+// larger than the whole ring, only its end is kept. Whether the oldest byte
+// left then starts a line depends on the byte before it, which is the last
+// one overwritten: note that before it is gone.
+void ring_write(struct ring_header *ring, const char *data, size_t len) {
+  char *area = ring_data(ring);
+  size_t size = (size_t)ring->size;
+  size_t head = (size_t)ring->head;
+  if (len > size) {
+    ring->cut = data[len - size - 1] != '\n';
+  } else if (len > 0 && (ring->wrapped || head + len > size)) {
+    ring->cut = area[(head + len - 1) % size] != '\n';
+  }
+  if (len >= size) {
+    memcpy(area, data + len - size, size);
+    ring->head = 0;
+    ring->wrapped = 1;
+    return;
+  }
+  size_t first = size - head < len ? size - head : len;
+  memcpy(area + head, data, first);
+  memcpy(area, data + first, len - first);
+  if (head + len >= size) {
+    ring->wrapped = 1;
+  }
+  ring->head = (head + len) % size;
+}
+
+void ring_close(struct ring_header *ring) {
+  size_t total = sizeof(struct ring_header) + (size_t)ring->size;
+  munmap(ring, total);
+}
+
+// --ring-read: print the records of ring file `path` to stdout, oldest first.
+// Once the ring has wrapped, the oldest line is usually cut short by the
+// newest records, and then output starts after the first newline past the
+// head - unless that newline ends the newest line, i.e. one line fills the
+// whole ring, whose end is printed as it is. Returns 0 on success.
+int ring_read(const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    fprintf(stderr, "Error opening ring file '%s': %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+  struct ring_header *ring = MAP_FAILED;
+  if ((size_t)st.st_size >= sizeof(struct ring_header)) {
+    ring = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (ring == MAP_FAILED ||
+      memcmp(ring->magic, RING_MAGIC, sizeof(ring->magic)) != 0 ||
+      ring->size != (uint64_t)st.st_size - sizeof(struct ring_header) ||
+      ring->head >= ring->size) {
+    fprintf(stderr, "Error: '%s' is not a t3 ring file\n", path);
+    return -1;
+  }
+  const char *area = ring_data(ring);
+  size_t size = (size_t)ring->size;
+  size_t head = (size_t)ring->head;
+  if (!ring->wrapped) {
+    fwrite(area, 1, head, stdout);
+  } else {
+    // `skip`: bytes of a cut oldest line to leave out, counted from the head.
+    size_t skip = 0;
+    if (ring->cut) {
+      const char *nl = memchr(area + head, '\n', size - head);
+      if (nl) {
+        skip = (size_t)(nl - (area + head)) + 1;
+      } else if ((nl = memchr(area, '\n', head)) != NULL) {
+        skip = size - head + (size_t)(nl - area) + 1;
+      }
+      if (skip == size) {
+        skip = 0;
+      }
+    }
+    if (skip < size - head) {
+      fwrite(area + head + skip, 1, size - head - skip, stdout);
+      fwrite(area, 1, head, stdout);
+    } else {
+      skip -= size - head;
+      fwrite(area + skip, 1, head - skip, stdout);
+    }
+  }
+  munmap(ring, (size_t)st.st_size);
+  return (fflush(stdout) == 0 && !ferror(stdout)) ? 0 : -1;
+}
+
+// --log-nocache: keep a large log file from crowding everything else out of
+// the page cache. Every NOCACHE_CHUNK bytes, the drain loop starts writeback
+// of the new chunk and drops the previous one - whose writeback has had a
+// whole chunk's worth of time to complete - from the cache. Where the
+// filesystem supports it, space is also reserved PREALLOC_EXTENT bytes at a
+// time ahead of the cursor (without changing the file size), so a growing log
+// is laid out in large extents rather than many small ones.
+#define NOCACHE_CHUNK (8 * 1024 * 1024)
+#define PREALLOC_EXTENT (64 * 1024 * 1024)
+int log_nocache = 0;
+
+void log_sink_release_cache(struct log_sink *sink) {
+  if (!sink->regular || sink->ring || sink->broken ||
+      sink->bytes - sink->cache_mark < NOCACHE_CHUNK) {
+    return;
+  }
+  sink->cache_mark = sink->bytes;
+  errno = 0;
+  if (fflush(sink->fp) != 0) {
+    output_write_error(sink->name, &sink->broken, errno ? errno : EIO);
+    return;
+  }
+  int fd = fileno(sink->fp);
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  if (pos == -1) {
+    return;
+  }
+#ifdef SYNC_FILE_RANGE_WRITE
+  if (sink->written_back > sink->released) {
+    off_t len = sink->written_back - sink->released;
+    sync_file_range(fd, sink->released, len,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, sink->released, len, POSIX_FADV_DONTNEED);
+    sink->released = sink->written_back;
+  }
+  sync_file_range(fd, sink->written_back, pos - sink->written_back,
+                  SYNC_FILE_RANGE_WRITE);
+  sink->written_back = pos;
+#elif defined(POSIX_FADV_DONTNEED)
+  // Without sync_file_range(), drop whatever the kernel has written back on
+  // its own; dirty pages are left alone.
+  posix_fadvise(fd, 0, pos, POSIX_FADV_DONTNEED);
+#endif
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (sink->prealloc_end != -1 && pos + NOCACHE_CHUNK > sink->prealloc_end) {
+    off_t start = pos > sink->prealloc_end ? pos : sink->prealloc_end;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, start, PREALLOC_EXTENT) == 0) {
+      sink->prealloc_end = start + PREALLOC_EXTENT;
+    } else {
+      sink->prealloc_end = -1; // e.g. EOPNOTSUPP; do not try again
+    }
+  }
+#endif
+}
+
+// Before a log file is closed (flushed already): give back the space reserved
+// past its end, and drop what is left of it from the page cache.
+void log_sink_end_file(struct log_sink *sink) {
+  if (!log_nocache || !sink->regular || sink->ring) {
+    return;
+  }
+  int fd = fileno(sink->fp);
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  if (pos == -1) {
+    return;
+  }
+  if (sink->prealloc_end > pos && ftruncate(fd, pos) == -1) {
+    _debug(1, "cannot release preallocated space of %s: %s", sink->path,
+           strerror(errno));
+  }
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+// Log rotation renames FILE to FILE.<N>, N counting up from 1, and moves a
+// spare segment - created ahead of time as FILE.next - into its place, so the
+// rotation itself is two renames and never waits on creating a file. A
+// segment is only ever started by a line, so an idle command leaves no empty
+// segments behind.
+
+static char *segment_path(const char *path, const char *suffix, unsigned n) {
+  size_t len = strlen(path) + strlen(suffix) + 16;
+  char *seg = xmalloc(len);
+  snprintf(seg, len, "%s.%u%s", path, n, suffix);
+  return seg;
+}
+
+static int path_exists(const char *path) {
+  struct stat st;
+  return lstat(path, &st) == 0;
+}
+
+// Advance `sink->segment` past numbers already used by FILE.<N> or FILE.<N>.gz,
+// so that a rotation never replaces a file it did not create.
+static void log_sink_skip_segments(struct log_sink *sink) {
+  for (;;) {
+    char *seg = segment_path(sink->path, "", sink->segment + 1);
+    char *gz = segment_path(sink->path, ".gz", sink->segment + 1);
+    int exists = path_exists(seg) || path_exists(gz);
+    free(seg);
+    free(gz);
+    if (!exists) {
+      break;
+    }
+    sink->segment++;
+  }
+}
+
+// Set up rotation for a freshly opened sink: skip past the segments a previous
+// run left behind.
+void log_sink_rotation_init(struct log_sink *sink) {
+  sink->segment_start = time(NULL);
+  log_sink_skip_segments(sink);
+}
+
+// Open the spare segment that the next rotation will move into place. Called
+// from the drain loop between batches of lines, rather than on the write path.
+void log_sink_prepare_spare(struct log_sink *sink) {
+  if (!sink->regular || sink->broken || sink->spare || sink->no_spare) {
+    return;
+  }
+  if (!sink->spare_path) {
+    sink->spare_path = xmalloc(strlen(sink->path) + sizeof(".next"));
+    sprintf(sink->spare_path, "%s.next", sink->path);
+  }
+  // O_EXCL: never truncate a FILE.next that t3 did not create. Without a spare
+  // the log goes on growing past the rotation point instead. O_CLOEXEC keeps
+  // the command from holding on to a file that t3 later renames or removes.
+  int fd =
+      open(sink->spare_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd != -1 && !(sink->spare = fdopen(fd, "w"))) {
+    close(fd);
+    unlink(sink->spare_path);
+  }
+  if (!sink->spare) {
+    _warn("cannot create %s: %s; not rotating %s", sink->spare_path,
+          strerror(errno), sink->path);
+    sink->no_spare = 1;
+  }
+}
+
+// Compress a closed segment with gzip in the background.
+static void compress_segment(const char *seg) {
+  char *argv[] = {"gzip", "-f", "--", (char *)seg, NULL};
+  pid_t pid;
+  int err = posix_spawnp(&pid, "gzip", NULL, NULL, argv, environ);
+  if (err != 0) {
+    _warn("cannot run gzip on %s: %s", seg, strerror(err));
+    return;
+  }
+  compressors =
+      xrealloc(compressors, (num_compressors + 1) * sizeof(*compressors));
+  compressors[num_compressors++] = pid;
+}
+
+// Collect finished gzip processes; with `block`, wait for all of them.
+void reap_compressors(int block) {
+  for (int i = num_compressors - 1; i >= 0; i--) {
+    int status;
+    pid_t done = waitpid(compressors[i], &status, block ? 0 : WNOHANG);
+    if (done == 0 || (done == -1 && errno == EINTR)) {
+      continue;
+    }
+    if (done == compressors[i] &&
+        (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+      _warn("gzip of a rotated log segment failed");
+    }
+    compressors[i] = compressors[--num_compressors];
+  }
+}
+
+// Close the current segment of `sink` as FILE.<N> and continue in the spare.
+// On failure the sink keeps writing to its current file and retries once the
+// next threshold is reached.
+static void log_sink_rotate(struct log_sink *sink, time_t now) {
+  sink->bytes = 0;
+  sink->cache_mark = 0;
+  sink->segment_start = now;
+  log_sink_prepare_spare(sink); // normally done already
+  if (!sink->spare) {
+    return;
+  }
+  log_sink_skip_segments(sink); // in case FILE.<N> appeared since
+  char *seg = segment_path(sink->path, "", sink->segment + 1);
+  if (rename(sink->path, seg) == -1) {
+    _warn("cannot rotate %s to %s: %s", sink->path, seg, strerror(errno));
+    free(seg);
+    return;
+  }
+  if (rename(sink->spare_path, sink->path) == -1) {
+    _warn("cannot rotate %s: %s", sink->path, strerror(errno));
+    rename(seg, sink->path);
+    free(seg);
+    return;
+  }
+  sink->segment++;
+  errno = 0;
+  if (fflush(sink->fp) != 0) {
+    output_write_error(sink->name, &sink->broken, errno ? errno : EIO);
+  }
+  log_sink_end_file(sink);
+  errno = 0;
+  if (fclose(sink->fp) != 0 && !sink->broken) {
+    output_write_error(sink->name, &sink->broken, errno ? errno : EIO);
+  }
+  sink->fp = sink->spare;
+  sink->spare = NULL;
+  sink->released = sink->written_back = sink->prealloc_end = 0;
+  if (rotate_compress) {
+    compress_segment(seg);
+  }
+  free(seg);
+}
+
+// Rotate `sink` first if writing `len` more bytes at time `now` would cross
+// the --rotate-size or --rotate-interval threshold.
+static void log_sink_maybe_rotate(struct log_sink *sink, time_t now,
+                                  size_t len) {
+  if (!sink->regular || sink->bytes == 0) {
+    return;
+  }
+  if ((rotate_size && sink->bytes + (off_t)len > rotate_size) ||
+      (rotate_interval && now - sink->segment_start >= rotate_interval)) {
+    struct timespec since;
+    if (show_stats) {
+      clock_gettime(CLOCK_MONOTONIC, &since);
+    }
+    log_sink_rotate(sink, now);
+    if (show_stats) {
+      sink->blocked_ns += elapsed_ns(&since);
+    }
+  }
+}
+
+// --listen: a Unix-domain socket streaming every emitted line, as a JSON Lines
+// record, to any number of local readers. The drain loop must never wait on a
+// reader, so subscriber sockets are nonblocking and each has a bounded queue
+// of the records its socket has not accepted yet. A reader that falls
+// SUBSCRIBER_BUFFER_SIZE bytes behind is disconnected; it can reconnect and
+// carry on from the live tail.
+struct subscriber {
+  int fd;
+  struct strbuf pending; // records not yet accepted by the socket
+  int joining;           // connected, but no line has started since
+};
+static const char *listen_path = NULL;
+static int listen_fd = -1;
+static struct subscriber *subscribers = NULL;
+static int num_subscribers = 0;
+// --stats: the longest queue any subscriber has had, how many subscribers
+// were disconnected for falling behind, and the time spent at exit waiting
+// for the rest to take their queues.
+static size_t max_subscriber_queued = 0;
+static int subscribers_dropped = 0;
+static uint64_t listen_blocked_ns = 0;
+
+// Create the --listen socket at `path`. A socket file left behind by a t3
+// that is gone (nothing accepts on it) is replaced; anything else at `path`
+// is an error. Returns 0 on success, -1 with errno set on failure.
+int listen_open(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  if (rc == -1 && errno == EADDRINUSE) {
+    struct stat st;
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe != -1 && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+        connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+        errno == ECONNREFUSED && unlink(path) == 0) {
+      rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } else {
+      errno = EADDRINUSE;
+    }
+    if (probe != -1) {
+      int err = errno;
+      close(probe);
+      errno = err;
+    }
+  }
+  if (rc == -1 || listen(fd, SOMAXCONN) == -1 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  listen_fd = fd;
+  listen_path = path;
+  return 0;
+}
+
+// Accept every pending connection on the --listen socket.
+void listen_accept(void) {
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+        _warn("accept(%s): %s", listen_path, strerror(errno));
+      }
+      return;
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+      close(fd);
+      continue;
+    }
+    subscribers =
+        xrealloc(subscribers, (num_subscribers + 1) * sizeof(*subscribers));
+    subscribers[num_subscribers++] = (struct subscriber){fd, {NULL, 0, 0}, 1};
+    _debug(1, "subscriber %d connected", fd);
+  }
+}
+
+static void subscriber_drop(int i, const char *reason) {
+  _debug(1, "subscriber %d dropped: %s", subscribers[i].fd, reason);
+  close(subscribers[i].fd);
+  free(subscribers[i].pending.buf);
+  subscribers[i] = subscribers[--num_subscribers];
+}
+
+// Hand a subscriber's socket as much of `data` as it takes without blocking.
+// Returns the number of bytes written, or -1 if the reader has gone away.
+static ssize_t subscriber_write(struct subscriber *sub, const char *data,
+                                size_t len) {
+  size_t off = 0;
+  while (off < len) {
+    ssize_t n = write(sub->fd, data + off, len - off);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    off += (size_t)n;
+  }
+  return (ssize_t)off;
+}
+
+// Write out as much of a subscriber's queue as its socket takes. Returns -1
+// if the reader has gone away.
+static int subscriber_flush(struct subscriber *sub) {
+  ssize_t n = subscriber_write(sub, sub->pending.buf, sub->pending.len);
+  if (n > 0) {
+    sub->pending.len -= (size_t)n;
+    memmove(sub->pending.buf, sub->pending.buf + n, sub->pending.len);
+  }
+  return n < 0 ? -1 : 0;
+}
+
+// Send a record to every subscriber: straight to the socket while its queue
+// is empty, else behind what is already queued. `starts` is clear for the
+// later pieces of a line sent in pieces, which a reader that connected after
+// the line began does not get.
+void subscribers_publish(const struct strbuf *record, int starts) {
+  for (int i = num_subscribers - 1; i >= 0; i--) {
+    struct subscriber *sub = &subscribers[i];
+    ssize_t n = 0;
+    if (sub->joining && !starts) {
+      continue;
+    }
+    sub->joining = 0;
+    if (sub->pending.len > 0) {
+      if (subscriber_flush(sub) == -1) {
+        subscriber_drop(i, strerror(errno));
+        continue;
+      }
+    }
+    if (sub->pending.len == 0) {
+      n = subscriber_write(sub, record->buf, record->len);
+      if (n == -1) {
+        subscriber_drop(i, strerror(errno));
+        continue;
+      }
+    }
+    size_t rest = record->len - (size_t)n;
+    if (sub->pending.len + rest > SUBSCRIBER_BUFFER_SIZE) {
+      subscriber_drop(i, "fell too far behind");
+      subscribers_dropped++;
+      continue;
+    }
+    strbuf_append(&sub->pending, record->buf + n, rest);
+    if (sub->pending.len > max_subscriber_queued) {
+      max_subscriber_queued = sub->pending.len;
+    }
+  }
+}
+
+// Retry every subscriber's queued records; called on each drain-loop pass so
+// a reader catches up even while no new lines arrive.
+void subscribers_flush(void) {
+  for (int i = num_subscribers - 1; i >= 0; i--) {
+    if (subscribers[i].pending.len > 0 &&
+        subscriber_flush(&subscribers[i]) == -1) {
+      subscriber_drop(i, strerror(errno));
+    }
+  }
+}
+
+// Give subscribers up to SUBSCRIBER_CLOSE_TIMEOUT_MS to take their queued
+// records, then disconnect them and remove the --listen socket.
+void listen_close(void) {
+  if (listen_fd == -1) {
+    return;
+  }
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (;;) {
+    subscribers_flush();
+    struct pollfd *pfds = xmalloc((num_subscribers + 1) * sizeof(*pfds));
+    nfds_t n = 0;
+    for (int i = 0; i < num_subscribers; i++) {
+      if (subscribers[i].pending.len > 0) {
+        pfds[n++] = (struct pollfd){subscribers[i].fd, POLLOUT, 0};
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
+                      (now.tv_nsec - start.tv_nsec) / 1000000;
+    if (n > 0 && elapsed_ms < SUBSCRIBER_CLOSE_TIMEOUT_MS) {
+      poll(pfds, n, (int)(SUBSCRIBER_CLOSE_TIMEOUT_MS - elapsed_ms));
+    }
+    free(pfds);
+    if (n == 0 || elapsed_ms >= SUBSCRIBER_CLOSE_TIMEOUT_MS) {
+      break;
+    }
+  }
+  listen_blocked_ns = elapsed_ns(&start);
+  while (num_subscribers > 0) {
+    subscriber_drop(num_subscribers - 1, "t3 is exiting");
+  }
+  free(subscribers);
+  subscribers = NULL;
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(listen_path);
+}
+
+// --highlight and --grep-out: rules selecting lines by literal patterns, each
+// a list of alternatives separated by '|' (e.g. "error:|warning:|FAILED").
+// All alternatives of all rules are compiled into one Aho-Corasick automaton,
+// flattened into a dense DFA, so matching a line is a single pass over its
+// bytes - one table lookup per byte - however many patterns there are.
+#define MAX_LINE_RULES 64
+
+struct line_rule {
+  const char *pattern;
+  const char *color; // for --highlight; NULL for --grep-out
+};
+static struct line_rule line_rules[MAX_LINE_RULES];
+static int num_line_rules = 0;
+static uint64_t highlight_rules = 0; // one bit per rule, by index
+static uint64_t grep_out_rules = 0;
+
+// The DFA: delta[state * 256 + byte] is the next state, and out[state] the
+// rules with an alternative ending at `state`. State 0 is the start.
+static int32_t *matcher_delta = NULL;
+static uint64_t *matcher_out = NULL;
+
+static const struct {
+  const char *name;
+  const char *sequence;
+} color_names[] = {
+    {"black", ANSI_COLOR_BLACK},   {"red", ANSI_COLOR_RED},
+    {"green", ANSI_COLOR_GREEN},   {"yellow", ANSI_COLOR_YELLOW},
+    {"blue", ANSI_COLOR_BLUE},     {"magenta", ANSI_COLOR_MAGENTA},
+    {"cyan", ANSI_COLOR_CYAN},     {"white", ANSI_COLOR_WHITE},
+    {"bold", ANSI_COLOR_BOLD},     {NULL, NULL}};
+
+// Register a --highlight PATTERN=COLOR (`spec`) or --grep-out PATTERN rule.
+// COLOR is a color name or, as with --outcolor, an escape sequence. Returns
+// 0 on success, -1 if the rule is malformed or there are too many.
+int add_line_rule(const char *spec, int highlight) {
+  if (num_line_rules == MAX_LINE_RULES) {
+    return -1;
+  }
+  size_t len = strlen(spec);
+  const char *color = NULL;
+  if (highlight) {
+    const char *eq = strrchr(spec, '=');
+    if (!eq) {
+      return -1;
+    }
+    len = (size_t)(eq - spec);
+    color = eq + 1;
+    for (int i = 0; color_names[i].name; i++) {
+      if (strcmp(color, color_names[i].name) == 0) {
+        color = color_names[i].sequence;
+        break;
+      }
+    }
+    if (color[0] != '\x1b') {
+      return -1;
+    }
+  }
+  // Every alternative must be non-empty: an empty one would match every line.
+  if (len == 0 || spec[0] == '|' || spec[len - 1] == '|' ||
+      memmem(spec, len, "||", 2)) {
+    return -1;
+  }
+  char *pattern = xmalloc(len + 1);
+  memcpy(pattern, spec, len);
+  pattern[len] = '\0';
+  struct line_rule *rule = &line_rules[num_line_rules];
+  rule->pattern = pattern;
+  rule->color = color;
+  *(highlight ? &highlight_rules : &grep_out_rules) |= 1ULL << num_line_rules;
+  num_line_rules++;
+  return 0;
+}
+
+// Compile the rules into the DFA.
+void build_line_matcher(void) {
+  if (num_line_rules == 0) {
+    return;
+  }
+  // A trie of every alternative has at most one state per pattern byte.
+  size_t max_states = 1;
+  for (int i = 0; i < num_line_rules; i++) {
+    max_states += strlen(line_rules[i].pattern);
+  }
+  int32_t *delta = xmalloc(max_states * 256 * sizeof(*delta));
+  uint64_t *out = xmalloc(max_states * sizeof(*out));
+  int32_t *fail = xmalloc(max_states * sizeof(*fail));
+  int32_t *queue = xmalloc(max_states * sizeof(*queue));
+  memset(delta, -1, max_states * 256 * sizeof(*delta));
+  memset(out, 0, max_states * sizeof(*out));
+  int32_t num_states = 1;
+
+  // Build the trie, where -1 marks a missing edge.
+  for (int i = 0; i < num_line_rules; i++) {
+    const char *p = line_rules[i].pattern;
+    while (*p) {
+      int32_t state = 0;
+      for (; *p && *p != '|'; p++) {
+        int32_t *edge = &delta[state * 256 + (unsigned char)*p];
+        if (*edge == -1) {
+          *edge = num_states++;
+        }
+        state = *edge;
+      }
+      out[state] |= 1ULL << i;
+      if (*p == '|') {
+        p++;
+      }
+    }
+  }
+
+  // Breadth first, fill in the failure links - the longest proper suffix of
+  // a state's string that is also in the trie - and replace each missing edge
+  // with its failure state's edge, which turns the trie into the DFA.
+  int head = 0, tail = 0;
+  for (int c = 0; c < 256; c++) {
+    int32_t child = delta[c];
+    if (child == -1) {
+      delta[c] = 0;
+    } else {
+      fail[child] = 0;
+      queue[tail++] = child;
+    }
+  }
+  while (head < tail) {
+    int32_t state = queue[head++];
+    out[state] |= out[fail[state]];
+    for (int c = 0; c < 256; c++) {
+      int32_t *edge = &delta[state * 256 + c];
+      int32_t fallback = delta[fail[state] * 256 + c];
+      if (*edge == -1) {
+        *edge = fallback;
+      } else {
+        fail[*edge] = fallback;
+        queue[tail++] = *edge;
+      }
+    }
+  }
+  free(fail);
+  free(queue);
+  matcher_delta = delta;
+  matcher_out = out;
+}
+
+// Return the set of rules matching a line.
+uint64_t match_line_rules(const char *text, size_t len) {
+  const int32_t *delta = matcher_delta;
+  const uint64_t *out = matcher_out;
+  uint64_t matched = 0;
+  int32_t state = 0;
+  for (size_t i = 0; i < len; i++) {
+    state = delta[state * 256 + (unsigned char)text[i]];
+    matched |= out[state];
+  }
+  return matched;
+}
+
+// t3's stdout and stderr. A consumer that stops reading must not stop the
+// log files, so output it has not taken yet is queued in a backlog and handed
+// over as poll() reports room, rather than written with a blocking fflush().
+// The descriptors themselves stay blocking - they usually share an open file
+// description with the shell or the command's stdin, where O_NONBLOCK would
+// leak - so a pipe or terminal is written through a second, private open file
+// description of its own, from /proc/self/fd, that is nonblocking, and a
+// socket with MSG_DONTWAIT. Each line is then a single write() taking what
+// fits, and poll() comes in only once a backlog has built up. Where neither
+// works, a pipe, socket or terminal is written only after POLLOUT, in
+// PIPE_BUF-sized pieces: a pipe reporting POLLOUT takes those whole, but a
+// terminal or a stream socket makes no such promise, so a stalled one can
+// still block t3 there. Other files (regular files, /dev/null) are written
+// directly. When stdout and stderr are the same file, e.g. with 2>&1, they
+// share one backlog, written through stdout, so lines stay in order.
+struct tty_out {
+  int fd;
+  const char *name;
+  int *broken;
+  int may_block;   // a pipe, socket or terminal
+  int nonblock_fd; // a nonblocking descriptor for it, or -1
+  int socket;      // a socket, written with MSG_DONTWAIT
+  struct strbuf backlog;
+  size_t max_backlog;  // --stats: the backlog's high-water mark
+  uint64_t blocked_ns; // and time spent waiting to write
+};
+static struct tty_out tty_outs[2] = {
+    {STDOUT_FILENO, "stdout", &stdout_broken, 0, -1, 0, {NULL, 0, 0}, 0, 0},
+    {STDERR_FILENO, "stderr", &stderr_broken, 0, -1, 0, {NULL, 0, 0}, 0, 0},
+};
+static struct tty_out *tty_stderr = NULL; // &tty_outs[1], or [0] if shared
+
+// Find a way to write to `out`, a pipe or terminal, without blocking: the
+// descriptor itself if it is nonblocking already, else a reopening of it.
+// Opening /proc/self/fd/N creates a new open file description on Linux, and
+// O_NONBLOCK on that one stays private to t3; where it is not (or there is no
+// such file), the flag does not take and the descriptor is not used.
+static void tty_out_open_nonblock(struct tty_out *out) {
+  int flags = fcntl(out->fd, F_GETFL);
+  if (flags != -1 && (flags & O_NONBLOCK)) {
+    out->nonblock_fd = out->fd;
+    return;
+  }
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", out->fd);
+  int fd = open(path, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || !(flags & O_NONBLOCK) ||
+      (fcntl(out->fd, F_GETFL) & O_NONBLOCK)) {
+    close(fd);
+    return;
+  }
+  out->nonblock_fd = fd;
+}
+
+static void tty_outs_init(void) {
+  struct stat st[2];
+  for (int i = 0; i < 2; i++) {
+    if (fstat(tty_outs[i].fd, &st[i]) == 0) {
+      tty_outs[i].may_block = S_ISFIFO(st[i].st_mode) ||
+                              S_ISSOCK(st[i].st_mode) ||
+                              isatty(tty_outs[i].fd);
+      tty_outs[i].socket = S_ISSOCK(st[i].st_mode);
+      if (tty_outs[i].may_block && !tty_outs[i].socket) {
+        tty_out_open_nonblock(&tty_outs[i]);
+      }
+    } else {
+      st[i].st_ino = (ino_t)i; // unknown: never considered shared
+      st[i].st_dev = 0;
+    }
+  }
+  tty_stderr = (st[0].st_dev == st[1].st_dev && st[0].st_ino == st[1].st_ino)
+                   ? &tty_outs[0]
+                   : &tty_outs[1];
+}
+
+// Write as much of `buf` as `out` takes without blocking. Returns the number
+// of bytes written, or -1 after a write error has been handled.
+static ssize_t tty_out_write(struct tty_out *out, const char *buf,
+                             size_t len) {
+  if (!out->may_block) {
+    struct timespec since;
+    if (show_stats) {
+      clock_gettime(CLOCK_MONOTONIC, &since);
+    }
+    if (write_full(out->fd, buf, len) == -1) {
+      output_write_error(out->name, out->broken, errno);
+      return -1;
+    }
+    if (show_stats) {
+      out->blocked_ns += elapsed_ns(&since);
+    }
+    return (ssize_t)len;
+  }
+  if (out->nonblock_fd != -1 || out->socket) {
+    ssize_t n;
+    do {
+      n = out->socket ? send(out->fd, buf, len, MSG_DONTWAIT)
+                      : write(out->nonblock_fd, buf, len);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      output_write_error(out->name, out->broken, errno);
+      return -1;
+    }
+    return n == -1 ? 0 : n;
+  }
+  size_t off = 0;
+  while (off < len) {
+    struct pollfd pfd = {out->fd, POLLOUT, 0};
+    if (poll(&pfd, 1, 0) != 1) {
+      break;
+    }
+    size_t chunk = len - off < PIPE_BUF ? len - off : PIPE_BUF;
+    ssize_t n = write(out->fd, buf + off, chunk);
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      output_write_error(out->name, out->broken, errno);
+      return -1;
+    }
+    off += (size_t)n;
+  }
+  return (ssize_t)off;
+}
+
+// Hand `out` as much of its backlog as it takes without blocking.
+static void tty_out_flush(struct tty_out *out) {
+  ssize_t n = tty_out_write(out, out->backlog.buf, out->backlog.len);
+  if (n == -1) {
+    out->backlog.len = 0;
+    return;
+  }
+  out->backlog.len -= (size_t)n;
+  memmove(out->backlog.buf, out->backlog.buf + n, out->backlog.len);
+}
+
+// Wait for `out` to take its backlog down to `limit` bytes, or to fail.
+static void tty_out_drain(struct tty_out *out, size_t limit) {
+  if (*out->broken || out->backlog.len <= limit) {
+    return;
+  }
+  struct timespec since;
+  clock_gettime(CLOCK_MONOTONIC, &since);
+  while (!*out->broken && out->backlog.len > limit) {
+    struct pollfd pfd = {out->fd, POLLOUT, 0};
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+      output_write_error(out->name, out->broken, errno);
+      out->backlog.len = 0;
+      break;
+    }
+    tty_out_flush(out);
+  }
+  out->blocked_ns += elapsed_ns(&since);
+}
+
+// Write to t3's stdout or stderr: straight through while nothing is queued,
+// else behind the backlog. Once a stream has broken, skip it so we neither
+// re-raise EPIPE nor emit repeated diagnostics for the same dead consumer.
+void write_tty(FILE *stream, const char *buf, size_t len) {
+  if (!tty_stderr) {
+    tty_outs_init();
+  }
+  struct tty_out *out = (stream == stderr) ? tty_stderr : &tty_outs[0];
+  if (*out->broken) {
+    return;
+  }
+  ssize_t n = 0;
+  if (out->backlog.len == 0) {
+    n = tty_out_write(out, buf, len);
+    if (n == -1) {
+      return;
+    }
+  }
+  strbuf_append(&out->backlog, buf + n, len - (size_t)n);
+  if (out->backlog.len > out->max_backlog) {
+    out->max_backlog = out->backlog.len;
+  }
+  tty_out_drain(out, TTY_BACKLOG_SIZE);
+}
+
+// Add a POLLOUT watch to `pfds` for each output with a backlog, or -1
+// (ignored by poll()) where there is none. `pfds` has two entries.
+void tty_outs_poll_events(struct pollfd *pfds) {
+  for (int i = 0; i < 2; i++) {
+    int pending = tty_stderr && (i == 0 || tty_stderr == &tty_outs[1]) &&
+                  tty_outs[i].backlog.len > 0;
+    pfds[i] = (struct pollfd){pending ? tty_outs[i].fd : -1, POLLOUT, 0};
+  }
+}
+
+// Retry the backlogs; called on each drain-loop pass.
+void tty_outs_flush(void) {
+  for (int i = 0; i < 2; i++) {
+    if (tty_outs[i].backlog.len > 0) {
+      tty_out_flush(&tty_outs[i]);
+    }
+  }
+}
+
+// At exit, wait for the consumers to take everything still queued.
+void tty_outs_finish(void) {
+  for (int i = 0; i < 2; i++) {
+    tty_out_drain(&tty_outs[i], 0);
+    free(tty_outs[i].backlog.buf);
+    tty_outs[i].backlog = (struct strbuf){NULL, 0, 0};
+  }
+}
+
+// --tty-max-rate: cap the lines per second written to stdout/stderr so that a
+// slow terminal cannot throttle the command through back-pressure. A token
+// bucket, holding up to a second's worth of lines, admits each line; lines
+// beyond it are elided from the terminal only - the log files still get
+// every one. The newest TTY_TAIL_LINES elided lines are kept, and once the
+// rate allows (or at exit) a "[t3: N lines elided, see log]" marker is
+// written followed by them, so the terminal always ends on the latest output.
+#define TTY_TAIL_LINES 8
+
+long tty_max_rate = 0;
+static double tty_tokens = 0;
+static struct timespec tty_refilled;
+static unsigned long tty_elided = 0;
+static struct {
+  FILE *stream;
+  const char *color;
+  struct strbuf record;
+} tty_tail[TTY_TAIL_LINES];
+static int tty_tail_start = 0, tty_tail_len = 0;
+
+// Write the elision marker and the retained newest lines.
+void tty_rate_flush(void) {
+  if (tty_elided == 0) {
+    return;
+  }
+  unsigned long hidden = tty_elided - (unsigned long)tty_tail_len;
+  if (hidden > 0) {
+    FILE *stream = tty_tail[tty_tail_start].stream;
+    const char *color = color_to_tty ? tty_tail[tty_tail_start].color : "";
+    char marker[128];
+    int len = snprintf(marker, sizeof(marker),
+                       "%s[t3: %lu line%s elided, see log]%s\n", color,
+                       hidden, hidden == 1 ? "" : "s",
+                       color_to_tty ? reset_color : "");
+    write_tty(stream, marker, (size_t)len);
+  }
+  for (int i = 0; i < tty_tail_len; i++) {
+    int slot = (tty_tail_start + i) % TTY_TAIL_LINES;
+    write_tty(tty_tail[slot].stream, tty_tail[slot].record.buf,
+              tty_tail[slot].record.len);
+  }
+  tty_elided = 0;
+  tty_tail_start = tty_tail_len = 0;
+}
+
+static void tty_rate_refill(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (tty_refilled.tv_sec == 0 && tty_refilled.tv_nsec == 0) {
+    tty_tokens = (double)tty_max_rate;
+  } else {
+    double elapsed = (double)(now.tv_sec - tty_refilled.tv_sec) +
+                     (double)(now.tv_nsec - tty_refilled.tv_nsec) / 1e9;
+    tty_tokens += elapsed * (double)tty_max_rate;
+    if (tty_tokens > (double)tty_max_rate) {
+      tty_tokens = (double)tty_max_rate;
+    }
+  }
+  tty_refilled = now;
+}
+
+// Decide whether a line may go to the terminal now. If not, it is counted as
+// elided and kept if it is among the newest.
+int tty_rate_admit(FILE *stream, const char *color,
+                   const struct strbuf *record) {
+  tty_rate_refill();
+  if (tty_tokens >= 1) {
+    tty_tokens -= 1;
+    tty_rate_flush();
+    return 1;
+  }
+  tty_elided++;
+  int slot;
+  if (tty_tail_len < TTY_TAIL_LINES) {
+    slot = (tty_tail_start + tty_tail_len++) % TTY_TAIL_LINES;
+  } else {
+    slot = tty_tail_start;
+    tty_tail_start = (tty_tail_start + 1) % TTY_TAIL_LINES;
+  }
+  tty_tail[slot].stream = stream;
+  tty_tail[slot].color = color;
+  tty_tail[slot].record.len = 0;
+  strbuf_append(&tty_tail[slot].record, record->buf, record->len);
+  return 0;
+}
+
+// Called on each pass of the drain loop: catch the terminal up once the rate
+// allows, or unconditionally with `force`.
+void tty_rate_tick(int force) {
+  if (tty_elided == 0) {
+    return;
+  }
+  tty_rate_refill();
+  if (force || tty_tokens >= 1) {
+    tty_tokens -= 1;
+    tty_rate_flush();
+  }
+}
+
+// Shorten a drain-loop poll() timeout so that elided lines are caught up on
+// as soon as the rate allows, even if the command has gone quiet.
+int tty_rate_poll_timeout(int timeout) {
+  if (tty_elided == 0) {
+    return timeout;
+  }
+  tty_rate_refill();
+  int wait_ms = tty_tokens >= 1
+                    ? 0
+                    : (int)((1 - tty_tokens) * 1000 / (double)tty_max_rate) + 1;
+  return wait_ms < timeout ? wait_ms : timeout;
+}
+
+// Format `ts` as a line's timestamp, HH:MM:SS.MMMMMM, either the time of day
+// or (with --relative) the time elapsed since t3 started, followed by
+// `suffix`.
+void format_timestamp(char *timestamp, size_t size, const struct timespec *ts,
+                      const char *suffix) {
+  if (relative_timestamps) {
+    // Write elapsed time since the start of the program as HH:MM:SS.MMMMMM.
+    // First calculate the elapsed time in seconds and nanoseconds.
+    long elapsed_sec = ts->tv_sec - start_timestamp.tv_sec;
+    long elapsed_nsec = ts->tv_nsec - start_timestamp.tv_nsec;
+    if (elapsed_nsec < 0) {
+      elapsed_sec--;
+      elapsed_nsec += 1000000000L;
+    }
+    // Then append the elapsed time to the timestamp string
+    // in HH:MM:SS.MMMMMM format along with the suffix.
+    int hours = elapsed_sec / 3600;
+    int minutes = (elapsed_sec % 3600) / 60;
+    int seconds = elapsed_sec % 60;
+    if (snprintf(timestamp, size, "%02d:%02d:%02d.%06ld%s", hours,
+                 minutes, seconds, // NOLINT
+                 (elapsed_nsec / 1000), suffix) >= size) {
+      _error("Timestamp truncated in format_timestamp");
+    }
+  } else {
+    struct tm *time_info = localtime(&ts->tv_sec);
+    if (!time_info) {
+      perror("localtime");
+      exit(EXIT_FAILURE);
+    }
+    // Set timestamp to HH:MM:SS.NNNNNNNNN
+    // First write the time in HH:MM:SS format
+    strftime(timestamp, size, "%H:%M:%S", time_info);
+    // Then append the nanoseconds and the suffix
+    size_t current_len = strlen(timestamp);
+    size_t remaining = size - current_len;
+    if (snprintf(timestamp + current_len, remaining, ".%06ld%s", // NOLINT
+                 ts->tv_nsec / 1000, suffix) >= remaining) {
+      _error("Nanoseconds truncated in format_timestamp");
+    }
+  }
+}
+
+// A line arriving in pieces (see MSG_CONTINUED) that has been started but not
+// yet ended on each stream, and the decisions taken on its first piece that
+// hold for the rest of it. `partial` is set while the latest piece was
+// forwarded by --partial-flush, i.e. the command is sitting on the line, and
+// `at_cr` while its text on the terminal so far ends in a '\r'.
+struct open_line {
+  int open;
+  const char *color;
+  int grep_out;
+  int partial;
+  int at_cr;
+};
+static struct open_line open_lines[2]; // stdout, stderr
+
+// The last '\r' in `len` bytes of `text`, or NULL. glibc's memrchr() scans a
+// word or more at a time, so a line without any '\r' costs little; it is a GNU
+// extension, though, missing e.g. on macOS, where a plain loop stands in.
+static const char *last_cr(const char *text, size_t len) {
+#ifdef __GLIBC__
+  return memrchr(text, '\r', len);
+#else
+  while (len > 0) {
+    if (text[--len] == '\r') {
+      return text + len;
+    }
+  }
+  return NULL;
+#endif
+}
+
+// In text redrawn with '\r', find what is left to be seen: the text after the
+// last '\r' that has any after it. Returns where it starts, with `*len` cut
+// down to it; that is `text` itself if there is no such '\r'. Trailing '\r's
+// only return the cursor for the next redraw, so they are left out, and
+// `*trailing` tells whether there were any.
+static const char *cr_segment(const char *text, size_t *len, int *trailing) {
+  *trailing = 0;
+  while (*len > 0 && text[*len - 1] == '\r') {
+    (*len)--;
+    *trailing = 1;
+  }
+  const char *cr = last_cr(text, *len);
+  if (!cr) {
+    return text;
+  }
+  *len -= (size_t)(cr + 1 - text);
+  return cr + 1;
+}
+
+// --log-compact-cr: a line redrawn with '\r', such as a progress bar, is
+// logged only as it finally stands, while the terminal still sees every
+// update. A line in pieces is held back from the log files as its current
+// state - its text since the last '\r' - until it ends, or that state alone
+// passes LINE_CHUNK_SIZE and is written out as it comes.
+int compact_cr_log = 0;
+struct cr_log {
+  int started;           // the line's record has been begun in the log files
+  int at_cr;             // its text so far ends in a '\r'
+  struct timespec stamp; // its timestamp,
+  char timestamp[100];   // and as rendered
+  struct strbuf state;   // its text since the last '\r', not yet logged
+};
+static struct cr_log cr_logs[2]; // stdout, stderr
+
+// Work out, in `lg`, what of `ln` goes to the log files with
+// --log-compact-cr, where `stripped` selects the text they take. Returns 0
+// if there is nothing to write for it yet.
+static int compact_cr(struct line *lg, const struct line *ln, int stripped,
+                      struct cr_log *c) {
+  const char *text = ln->text[stripped];
+  size_t len = ln->length[stripped];
+  int trailing;
+  const char *seg = cr_segment(text, &len, &trailing);
+  *lg = *ln;
+  if (ln->starts && ln->ends) {
+    // A whole line, the usual case: cut down in place.
+    lg->text[stripped] = seg;
+    lg->length[stripped] = len;
+    return 1;
+  }
+  if (ln->starts) {
+    c->started = 0;
+    c->at_cr = 0;
+    c->state.len = 0;
+    c->stamp = *ln->stamp;
+    snprintf(c->timestamp, sizeof(c->timestamp), "%s", ln->timestamp);
+  }
+  if (len > 0) {
+    if (seg != text || c->at_cr) {
+      c->state.len = 0;
+    }
+    strbuf_append(&c->state, seg, len);
+    c->at_cr = trailing;
+  } else {
+    c->at_cr = c->at_cr || trailing;
+  }
+  if (!ln->ends && c->state.len < LINE_CHUNK_SIZE) {
+    return 0;
+  }
+  lg->starts = !c->started;
+  lg->stamp = &c->stamp;
+  lg->timestamp = c->timestamp;
+  lg->text[stripped] = c->state.buf;
+  lg->length[stripped] = c->state.len;
+  // Written before the next piece is added, so the text stays in place.
+  c->started = 1;
+  c->state.len = 0;
+  return 1;
+}
+
+void process_msg_payload(FILE *stream, const char *color,
+                         struct payload *msg_payload) {
+  struct open_line *open_line = &open_lines[stream == stderr];
+  char timestamp[100];
+  if (timestamp_enabled) {
+    format_timestamp(timestamp, sizeof(timestamp), &msg_payload->timestamp,
+                     " ");
+  } else {
+    // Make sure timestamp is empty
+    timestamp[0] = '\0';
+  }
+  int stream_bit = (stream == stderr) ? STREAM_STDERR : STREAM_STDOUT;
+  struct line ln = {
+      .starts = !open_line->open,
+      .ends = !(msg_payload->flags & MSG_CONTINUED),
+      .stamp = &msg_payload->timestamp,
+      .stream_name = (stream == stderr) ? "stderr" : "stdout",
+      .color = color,
+      .timestamp = timestamp,
+      .text = {msg_payload->text, msg_payload->text},
+      .length = {msg_payload->length, msg_payload->length},
+  };
+  line_serial++;
+
+  // The command's own escape sequences, stripped from either rendition on
+  // request. A line boundary ends any sequence left open, so the stripper
+  // starts each line afresh (but carries on across the pieces of one).
+  if (strip_ansi_log || strip_ansi_tty) {
+    struct ansi_stripper *stripper =
+        (stream == stderr) ? &stderr_stripper : &stdout_stripper;
+    ln.text[1] =
+        ansi_strip(stripper, msg_payload->text, msg_payload->length,
+                   &ln.length[1]);
+    if (ln.ends) {
+      stripper->state = ANSI_GROUND;
+    }
+  }
+
+  // --highlight recolors the line, taking the first matching rule's color;
+  // --grep-out keeps it off the terminal. Both see the text as stripped. A
+  // line in pieces is judged by its first piece.
+  int grep_out = 0;
+  if (!ln.starts) {
+    ln.color = open_line->color;
+    grep_out = open_line->grep_out;
+  } else if (num_line_rules > 0) {
+    uint64_t matched = match_line_rules(ln.text[1], ln.length[1]);
+    if (matched & highlight_rules) {
+      ln.color = line_rules[__builtin_ctzll(matched & highlight_rules)].color;
+    }
+    grep_out = (matched & grep_out_rules) != 0;
+  }
+  // With --partial-flush, a progress bar redrawn with '\r' is shown on the
+  // terminal only as it now stands: the text after the last '\r' (trailing
+  // ones aside, which only move the cursor for the next update), redrawn over
+  // the line from its start with a fresh timestamp prefix.
+  const char *tty_text = ln.text[strip_ansi_tty];
+  size_t tty_len = ln.length[strip_ansi_tty];
+  int redraw = 0, at_cr = !ln.starts && open_line->at_cr;
+  if (partial_flush_ms > 0) {
+    int trailing_cr;
+    const char *seg = cr_segment(tty_text, &tty_len, &trailing_cr);
+    if (tty_len > 0) {
+      redraw = seg != tty_text || at_cr;
+      at_cr = trailing_cr;
+    } else {
+      at_cr = at_cr || trailing_cr;
+    }
+    tty_text = seg;
+  }
+  *open_line = (struct open_line){!ln.ends, ln.color, grep_out,
+                                  (msg_payload->flags & MSG_PARTIAL) != 0,
+                                  at_cr};
+
+  // Log files: the primary artifact. As text they always carry the configured
+  // color and timestamp markup - which --plain empties and the timestamp
+  // options enable - and, unlike the stdout/stderr streams, keep that color
+  // even when those streams are not a TTY; plain text drops the color, and
+  // JSON Lines carries the raw timestamp and stream name instead. They are
+  // not flushed per line for performance; errors that have surfaced are
+  // caught here and each file is re-checked definitively at fclose().
+  struct line compacted;
+  const struct line *logged = &ln;
+  int log_now = 1;
+  if (compact_cr_log) {
+    log_now = compact_cr(&compacted, &ln, strip_ansi_log,
+                         &cr_logs[stream == stderr]);
+    logged = &compacted;
+  }
+  for (int i = 0; log_now && i < num_log_sinks; i++) {
+    struct log_sink *sink = &log_sinks[i];
+    if (sink->broken || !(sink->streams & stream_bit)) {
+      continue;
+    }
+    const struct strbuf *record =
+        line_rendition(logged, sink->format, strip_ansi_log);
+    if (sink->ring) {
+      ring_write(sink->ring, record->buf, record->len);
+      logged_bytes += (off_t)record->len;
+      continue;
+    }
+    if ((rotate_size || rotate_interval) && logged->starts) {
+      log_sink_maybe_rotate(sink, msg_payload->timestamp.tv_sec, record->len);
+    }
+    // Clear errno first, then capture it the instant the write reports failure
+    // (via the fwrite return or ferror), before any other call can clobber
+    // it. A failure seen only through the error indicator - which does not set
+    // errno - is reported as EIO. No clearerr(): the sink is marked broken and
+    // skipped from here on.
+    struct timespec since;
+    if (show_stats) {
+      clock_gettime(CLOCK_MONOTONIC, &since);
+    }
+    errno = 0;
+    size_t wrote = fwrite(record->buf, 1, record->len, sink->fp);
+    int err = errno;
+    if (show_stats) {
+      sink->blocked_ns += elapsed_ns(&since);
+    }
+    if (wrote != record->len || ferror(sink->fp)) {
+      output_write_error(sink->name, &sink->broken, err ? err : EIO);
+    }
+    sink->bytes += (off_t)wrote;
+    logged_bytes += (off_t)wrote;
+  }
+  if (compact_cr_log) {
+    line_serial++; // the renditions so far were of the compacted line
+  }
+
+  if (num_subscribers > 0) {
+    subscribers_publish(line_rendition(&ln, LOG_FORMAT_JSONL, strip_ansi_log),
+                        ln.starts);
+  }
+
+  if (grep_out) {
+    return;
+  }
+  enum log_format tty_format =
+      color_to_tty ? LOG_FORMAT_TEXT : LOG_FORMAT_PLAIN;
+  const struct strbuf *record = line_rendition(&ln, tty_format, strip_ansi_tty);
+  if (redraw || tty_len != ln.length[strip_ansi_tty]) {
+    static struct strbuf redrawn;
+    struct line shown = ln;
+    shown.starts = ln.starts || redraw;
+    shown.text[strip_ansi_tty] = tty_text;
+    shown.length[strip_ansi_tty] = tty_len;
+    render_line(&redrawn, &shown, tty_format, strip_ansi_tty);
+    record = &redrawn;
+    if (redraw && !ln.starts) {
+      write_tty(stream, "\r", 1);
+    }
+  }
+  if (!(ln.starts && ln.ends)) {
+    // Part of a line in pieces: always shown, as it cannot be held back
+    // whole for --tty-max-rate, after any lines elided before it.
+    if (tty_max_rate && ln.starts) {
+      tty_rate_tick(1);
+    }
+    write_tty(stream, record->buf, record->len);
+  } else if (tty_max_rate == 0 || tty_rate_admit(stream, color, record)) {
+    write_tty(stream, record->buf, record->len);
+  }
+}
+
+// --collapse-repeats: a line identical to the previous one on the same stream
+// is not emitted. Once a different line arrives on that stream (or at exit)
+// a single summary line stands in for all the copies. Lines are compared by
+// an FNV-1a hash first, so a run of distinct lines costs one hash each and
+// only a matching hash pays for the memcmp() that confirms it.
+struct repeat_state {
+  int have_last;
+  uint64_t hash;
+  struct strbuf last;           // text of the last line emitted on the stream
+  unsigned long count;          // copies of it suppressed since
+  struct timespec first_copy;   // timestamp of the first suppressed copy
+  struct timespec latest_copy;  // and of the latest
+};
+int collapse_repeats = 0;
+static struct repeat_state repeat_states[2]; // stdout, stderr
+
+static uint64_t fnv1a(const char *data, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Emit the summary of the copies suppressed on `stream`, if any.
+void flush_repeats(FILE *stream, const char *color) {
+  struct repeat_state *r = &repeat_states[stream == stderr];
+  if (r->count == 0) {
+    return;
+  }
+  char first[64], latest[64], text[200];
+  format_timestamp(first, sizeof(first), &r->first_copy, "");
+  format_timestamp(latest, sizeof(latest), &r->latest_copy, "");
+  int len =
+      r->count == 1
+          ? snprintf(text, sizeof(text),
+                     "[t3: previous line repeated 1 more time at %s]", first)
+          : snprintf(text, sizeof(text),
+                     "[t3: previous line repeated %lu more times, %s to %s]",
+                     r->count, first, latest);
+  struct payload *summary = xmalloc(sizeof(*summary) + (size_t)len + 1);
+  summary->timestamp = r->latest_copy;
+  summary->length = (uint32_t)len;
+  summary->flags = 0;
+  memcpy(summary->text, text, (size_t)len + 1);
+  r->count = 0;
+  process_msg_payload(stream, color, summary);
+  free(summary);
+}
+
+// End a line in pieces left open on `stream` with an empty last piece.
+static void end_open_line(FILE *stream, const char *color) {
+  if (!open_lines[stream == stderr].open) {
+    return;
+  }
+  struct payload last = {{0, 0}, 0, 0};
+  clock_gettime(CLOCK_REALTIME, &last.timestamp);
+  process_msg_payload(stream, color, &last);
+}
+
+// Emit a line from the drain loop, collapsing repeats when enabled. A line in
+// pieces is never taken for a repeat.
+void emit_line(FILE *stream, const char *color, struct payload *msg_payload) {
+  if (!collapse_repeats) {
+    process_msg_payload(stream, color, msg_payload);
+    return;
+  }
+  struct repeat_state *r = &repeat_states[stream == stderr];
+  if (open_lines[stream == stderr].open ||
+      (msg_payload->flags & MSG_CONTINUED)) {
+    flush_repeats(stream, color);
+    r->have_last = 0;
+    process_msg_payload(stream, color, msg_payload);
+    return;
+  }
+  uint64_t hash = fnv1a(msg_payload->text, msg_payload->length);
+  if (r->have_last && hash == r->hash && msg_payload->length == r->last.len &&
+      memcmp(msg_payload->text, r->last.buf, r->last.len) == 0) {
+    if (r->count++ == 0) {
+      r->first_copy = msg_payload->timestamp;
+    }
+    r->latest_copy = msg_payload->timestamp;
+    return;
+  }
+  flush_repeats(stream, color);
+  r->have_last = 1;
+  r->hash = hash;
+  r->last.len = 0;
+  strbuf_append(&r->last, msg_payload->text, msg_payload->length);
+  process_msg_payload(stream, color, msg_payload);
+}
+
+// Emit queued messages to the sinks, always taking whichever stream's head is
+// older so the two streams interleave in timestamp order. With `hold` set,
+// a head younger than MESSAGE_HOLD_MS (relative to `current_time`) is not yet
+// ready, giving a slightly later line on the other stream the chance to
+// arrive and sort ahead of it. Returns when nothing more is ready, or early
+// if a fatal write error has fired.
+//
+// Once the first piece of a line in pieces (see MSG_CONTINUED) is out, its
+// stream holds the sinks until the line ends: nothing from the other stream
+// may land in the middle of it, and its later pieces go out as they arrive.
+void drain_queues(const char *out_color, const char *err_color,
+                  const struct timespec *current_time, int hold) {
+  long ms_delta = 0;
+  while ((stdout_head || stderr_head) && !output_error_fatal) {
+    _debug(1,
+           "stdout/stderr queuelen = %d/%d, stdout_head = %p stderr_head = %p",
+           stdout_queuelen, stderr_queuelen, stdout_head, stderr_head);
+    struct message *stdout_ready = NULL;
+    struct message *stderr_ready = NULL;
+
+    // A line the command is sitting on (see --partial-flush), at a prompt or
+    // redrawing a progress bar, holds the sinks only while nothing is ready
+    // on the other stream. Then it is ended where it stands, and the rest of
+    // it, should it come, starts a line of its own.
+    for (int i = 0; i < 2; i++) {
+      struct message *other = i ? stdout_head : stderr_head;
+      if (open_lines[i].partial && !(i ? stderr_head : stdout_head) && other &&
+          (!hold || timespec_ms_delta(current_time,
+                                      &other->msg_payload->timestamp) >=
+                        MESSAGE_HOLD_MS)) {
+        end_open_line(i ? stderr : stdout, i ? err_color : out_color);
+      }
+    }
+
+    if (open_lines[0].open || open_lines[1].open) {
+      // A line in pieces is under way on one stream: only that stream's
+      // pieces are ready, however recent.
+      if (open_lines[0].open) {
+        stdout_ready = stdout_head;
+      } else {
+        stderr_ready = stderr_head;
+      }
+    } else if (hold) {
+      // Create pointers to the head of each of the queues, but only
+      // if they are not too new.
+      if (stdout_head) {
+        ms_delta = timespec_ms_delta(current_time,
+                                     &stdout_head->msg_payload->timestamp);
+        if (ms_delta >= MESSAGE_HOLD_MS) {
+          stdout_ready = stdout_head;
+        } else {
+          _debug(2, "message on stdout not ready to send after only %ldms",
+                 ms_delta);
+        }
+      }
+      if (stderr_head) {
+        ms_delta = timespec_ms_delta(current_time,
+                                     &stderr_head->msg_payload->timestamp);
+        if (ms_delta >= MESSAGE_HOLD_MS) {
+          stderr_ready = stderr_head;
+        } else {
+          _debug(2, "message on stderr not ready to send after only %ldms",
+                 ms_delta);
+        }
+      }
+    } else {
+      // If the message pipes are closed, go ahead and process the
+      // remaining messages irrespective of their age.
+      stdout_ready = stdout_head;
+      stderr_ready = stderr_head;
+    }
+
+    // Process whichever message is older.
+    if (stdout_ready && stderr_ready) {
+      // Compare timestamps to determine which to write first
+      if (timespec_cmp(&stdout_ready->msg_payload->timestamp,
+                       &stderr_ready->msg_payload->timestamp) <= 0) {
+        emit_line(stdout, out_color, stdout_ready->msg_payload);
+        shift(&stdout_head, &stdout_tail, &stdout_queuelen,
+              &stdout_queued_bytes);
+      } else {
+        emit_line(stderr, err_color, stderr_ready->msg_payload);
+        shift(&stderr_head, &stderr_tail, &stderr_queuelen,
+              &stderr_queued_bytes);
+      }
+    } else if (stdout_ready) {
+      // Write stdout message if only stdout is ready
+      emit_line(stdout, out_color, stdout_ready->msg_payload);
+      shift(&stdout_head, &stdout_tail, &stdout_queuelen,
+            &stdout_queued_bytes);
+    } else if (stderr_ready) {
+      // Write stderr message if only stderr is ready
+      emit_line(stderr, err_color, stderr_ready->msg_payload);
+      shift(&stderr_head, &stderr_tail, &stderr_queuelen,
+            &stderr_queued_bytes);
+    } else {
+      break;
+    }
+  }
+  // Once the message pipes are closed nothing else will end a run of copies,
+  // nor a line in pieces whose worker died before sending its last piece.
+  if (!hold && !output_error_fatal) {
+    end_open_line(stdout, out_color);
+    end_open_line(stderr, err_color);
+    flush_repeats(stdout, out_color);
+    flush_repeats(stderr, err_color);
+  }
+  if (tty_max_rate && !output_error_fatal) {
+    tty_rate_tick(!hold);
+  }
+}
+
+// Shorten a drain-loop poll() timeout so that a line the command is sitting
+// on (see --partial-flush) goes out, or gives way to the other stream, as
+// soon as MESSAGE_HOLD_MS is up rather than on the next message.
+int partial_poll_timeout(int timeout) {
+  if (partial_flush_ms == 0) {
+    return timeout;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  for (int i = 0; i < 2; i++) {
+    struct message *head = i ? stderr_head : stdout_head;
+    if (!head || (open_lines[!i].open && !open_lines[!i].partial)) {
+      continue;
+    }
+    long wait_ms = MESSAGE_HOLD_MS + 1 -
+                   timespec_ms_delta(&now, &head->msg_payload->timestamp);
+    if (wait_ms < timeout) {
+      timeout = wait_ms < 0 ? 0 : (int)wait_ms;
+    }
+  }
+  return timeout;
+}
+
+// Register a log sink; its file is opened later by open_log_sinks().
+void add_log_sink(const char *name, const char *path, enum log_format format,
+                  int streams) {
+  log_sinks = xrealloc(log_sinks, (num_log_sinks + 1) * sizeof(*log_sinks));
+  struct log_sink *sink = &log_sinks[num_log_sinks++];
+  memset(sink, 0, sizeof(*sink));
+  sink->name = name;
+  sink->path = path;
+  sink->format = format;
+  sink->streams = streams;
+}
+
+// A unit suffix accepted by parse_scaled() and the factor it stands for.
+struct unit {
+  const char *suffix;
+  off_t factor;
+};
+static const struct unit size_units[] = {
+    {"", 1}, {"K", 1024}, {"M", 1024 * 1024}, {"G", 1024 * 1024 * 1024},
+    {NULL, 0}};
+static const struct unit time_units[] = {
+    {"", 1}, {"s", 1}, {"m", 60}, {"h", 3600}, {"d", 86400}, {NULL, 0}};
+static const struct unit ms_units[] = {
+    {"", 1}, {"ms", 1}, {"s", 1000}, {"m", 60 * 1000}, {NULL, 0}};
+
+// Parse a positive whole number with an optional unit suffix, e.g. "64M" or
+// "12h". Returns 0 on success, -1 if it is malformed, zero, or overflows.
+static int parse_scaled(const char *arg, const struct unit *units,
+                        off_t *value) {
+  char *end;
+  errno = 0;
+  long long n = strtoll(arg, &end, 10);
+  if (end == arg || errno == ERANGE || n <= 0) {
+    return -1;
+  }
+  for (const struct unit *u = units; u->suffix; u++) {
+    if (strcmp(end, u->suffix) == 0) {
+      if (n > INT64_MAX / u->factor) {
+        return -1;
+      }
+      *value = (off_t)(n * u->factor);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Parse a record format name. Returns 0 on success, -1 if it is unknown.
+static int parse_log_format(const char *name, enum log_format *format) {
+  if (strcmp(name, "text") == 0) {
+    *format = LOG_FORMAT_TEXT;
+  } else if (strcmp(name, "plain") == 0) {
+    *format = LOG_FORMAT_PLAIN;
+  } else if (strcmp(name, "jsonl") == 0) {
+    *format = LOG_FORMAT_JSONL;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// Parse a stream filter name. Returns 0 on success, -1 if it is unknown.
+static int parse_log_streams(const char *name, int *streams) {
+  if (strcmp(name, "stdout") == 0) {
+    *streams = STREAM_STDOUT;
+  } else if (strcmp(name, "stderr") == 0) {
+    *streams = STREAM_STDERR;
+  } else if (strcmp(name, "both") == 0) {
+    *streams = STREAM_STDOUT | STREAM_STDERR;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// Register a --log FILE[:FORMAT][:STREAM] sink. Suffixes are recognized from
+// the right and only when they name a format or stream, so a file name may
+// itself contain colons. Returns 0 on success, -1 for an empty file name.
+static int add_log_sink_spec(const char *spec) {
+  size_t path_len = strlen(spec);
+  char *path = xmalloc(path_len + 1);
+  memcpy(path, spec, path_len + 1);
+  enum log_format format = LOG_FORMAT_TEXT;
+  int streams = STREAM_STDOUT | STREAM_STDERR;
+  int have_format = 0, have_streams = 0;
+  char *colon;
+  while ((colon = strrchr(path, ':')) != NULL) {
+    if (!have_format && parse_log_format(colon + 1, &format) == 0) {
+      have_format = 1;
+    } else if (!have_streams && parse_log_streams(colon + 1, &streams) == 0) {
+      have_streams = 1;
+    } else {
+      break;
+    }
+    *colon = '\0';
+  }
+  if (path[0] == '\0') {
+    free(path);
+    return -1;
+  }
+  add_log_sink(path, path, format, streams);
+  return 0;
+}
+
+// Open every registered log sink for writing, truncating or (with `append`)
+// appending. Returns 0 on success; on failure reports which file could not be
+// opened and returns -1.
+int open_log_sinks(int append) {
+  for (int i = 0; i < num_log_sinks; i++) {
+    struct log_sink *sink = &log_sinks[i];
+    if (sink->ring_size) {
+      int rc = ring_open(sink, append);
+      if (rc != 0) {
+        if (rc == -1) {
+          fprintf(stderr, "Error opening logfile '%s': %s\n", sink->path,
+                  strerror(errno));
+        }
+        return -1;
+      }
+      continue;
+    }
+    sink->fp = fopen(sink->path, append ? "a" : "w");
+    if (!sink->fp) {
+      fprintf(stderr, "Error opening logfile '%s': %s\n", sink->path,
+              strerror(errno));
+      return -1;
+    }
+    struct stat st;
+    if (fstat(fileno(sink->fp), &st) == 0 && S_ISREG(st.st_mode)) {
+      sink->regular = 1;
+      sink->bytes = st.st_size; // what --append kept
+      sink->cache_mark = st.st_size;
+    }
+    if (rotate_size || rotate_interval) {
+      log_sink_rotation_init(sink);
+      log_sink_prepare_spare(sink);
+    }
+  }
+  return 0;
+}
+
+// Between batches of lines: replace the spare segments used up by rotations,
+// collect finished compressors, and release written log data from the page
+// cache.
+void log_sinks_tick(void) {
+  for (int i = 0; i < num_log_sinks; i++) {
+    struct log_sink *sink = &log_sinks[i];
+    struct timespec since;
+    if (show_stats) {
+      clock_gettime(CLOCK_MONOTONIC, &since);
+    }
+    if (rotate_size || rotate_interval) {
+      log_sink_prepare_spare(sink);
+    }
+    if (log_nocache) {
+      log_sink_release_cache(sink);
+    }
+    if (show_stats) {
+      sink->blocked_ns += elapsed_ns(&since);
+    }
+  }
+  if (rotate_size || rotate_interval) {
+    reap_compressors(0);
+  }
+}
+
+// Flush and close every log sink. With `report` set, apply the --output-error
+// policy to any deferred write error (e.g. a full disk) or a close(2) failure
+// (e.g. on a networked filesystem) that only surfaces now; without it, just
+// salvage what can be written on the way out.
+static void close_log_sink(struct log_sink *sink, int report) {
+  if (sink->spare) {
+    fclose(sink->spare);
+    unlink(sink->spare_path);
+  }
+  if (sink->ring) {
+    ring_close(sink->ring);
+    return;
+  }
+  if (!report) {
+    if (!sink->broken) {
+      fflush(sink->fp);
     }
+    log_sink_end_file(sink);
+    fclose(sink->fp);
     return;
   }
-  _error("internal error: unhandled output_error mode %d", output_error);
-  abort();
+  errno = 0;
+  if (!sink->broken && (fflush(sink->fp) != 0 || ferror(sink->fp))) {
+    output_write_error(sink->name, &sink->broken, errno ? errno : EIO);
+  }
+  log_sink_end_file(sink);
+  errno = 0;
+  if (fclose(sink->fp) != 0 && !sink->broken) {
+    output_write_error(sink->name, &sink->broken, errno ? errno : EIO);
+  }
 }
 
-void process_msg_payload(FILE *stream, FILE *logfile, const char *color,
-                         struct payload *msg_payload) {
-  // Write stderr message if only stderr is ready
-  char timestamp[100];
-  if (timestamp_enabled) {
-    if (relative_timestamps) {
-      // Write elapsed time since the start of the program as HH:MM:SS.MMMMMM.
-      // First calculate the elapsed time in seconds and nanoseconds.
-      long elapsed_sec = msg_payload->timestamp.tv_sec - start_timestamp.tv_sec;
-      long elapsed_nsec =
-          msg_payload->timestamp.tv_nsec - start_timestamp.tv_nsec;
-      if (elapsed_nsec < 0) {
-        elapsed_sec--;
-        elapsed_nsec += 1000000000L;
+void close_log_sinks(int report) {
+  for (int i = 0; i < num_log_sinks; i++) {
+    struct log_sink *sink = &log_sinks[i];
+    struct timespec since;
+    if (show_stats) {
+      clock_gettime(CLOCK_MONOTONIC, &since);
+    }
+    close_log_sink(sink, report);
+    if (show_stats) {
+      sink->blocked_ns += elapsed_ns(&since);
+    }
+  }
+}
+
+// --sync: group commit for the log files. The drain loop never waits on the
+// disk: when a batch is due it flushes the stdio buffers itself and hands a
+// request - dup()s of the log files' descriptors, which stay valid even if a
+// rotation closes the originals - to a background thread that fdatasync()s
+// them. A request posted while the thread is still busy replaces any older
+// one still waiting, so a slow disk means fewer, larger syncs rather than a
+// growing queue.
+struct sync_target {
+  int sink; // index into log_sinks, for error reports
+  int fd;   // a dup() of the sink's descriptor, or -1 for a ring
+  struct ring_header *ring;
+};
+struct sync_request {
+  struct sync_target *targets;
+  int num_targets;
+  off_t logged; // logged_bytes when the request was made
+};
+static pthread_t sync_thread;
+static int sync_thread_started = 0;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_wake = PTHREAD_COND_INITIALIZER;
+// Shared with the sync thread, under sync_lock:
+static struct sync_request *sync_pending = NULL;
+static int sync_stop = 0;
+static int sync_error = 0, sync_error_sink = -1; // first failure, if any
+static off_t durable_bytes = 0; // logged bytes known to be on stable storage
+// Drain loop only:
+static off_t requested_bytes = 0; // logged_bytes at the last request
+static off_t max_sync_lag = 0;    // for --stats: the largest lag seen
+static struct timespec last_request;
+
+static struct sync_request *sync_request_new(void) {
+  struct sync_request *req = xmalloc(sizeof(*req));
+  req->targets = xmalloc(num_log_sinks * sizeof(*req->targets));
+  req->num_targets = 0;
+  req->logged = logged_bytes;
+  for (int i = 0; i < num_log_sinks; i++) {
+    struct log_sink *sink = &log_sinks[i];
+    if (sink->broken) {
+      continue;
+    }
+    struct sync_target *t = &req->targets[req->num_targets];
+    t->sink = i;
+    t->fd = -1;
+    t->ring = sink->ring;
+    if (!sink->ring) {
+      struct timespec since;
+      if (show_stats) {
+        clock_gettime(CLOCK_MONOTONIC, &since);
       }
-      // Then append the elapsed time to the timestamp string
-      // in HH:MM:SS.MMMMMM format along with a trailing space.
-      int hours = elapsed_sec / 3600;
-      int minutes = (elapsed_sec % 3600) / 60;
-      int seconds = elapsed_sec % 60;
-      if (snprintf(timestamp, sizeof(timestamp), "%02d:%02d:%02d.%06ld ", hours,
-                   minutes, seconds, // NOLINT
-                   (elapsed_nsec / 1000)) >= sizeof(timestamp)) {
-        _error("Timestamp truncated in process_msg_payload");
+      errno = 0;
+      int flushed = fflush(sink->fp) == 0 && !ferror(sink->fp);
+      int err = errno;
+      if (show_stats) {
+        sink->blocked_ns += elapsed_ns(&since);
       }
-    } else {
-      struct tm *time_info = localtime(&msg_payload->timestamp.tv_sec);
-      if (!time_info) {
-        perror("localtime");
-        exit(EXIT_FAILURE);
+      if (!flushed) {
+        output_write_error(sink->name, &sink->broken, err ? err : EIO);
+        continue;
       }
-      // Set timestamp to HH:MM:SS.NNNNNNNNN
-      // First write the time in HH:MM:SS format
-      strftime(timestamp, sizeof(timestamp), "%H:%M:%S", time_info);
-      // Then append the nanoseconds and a space
-      size_t current_len = strlen(timestamp);
-      size_t remaining = sizeof(timestamp) - current_len;
-      if (snprintf(timestamp + current_len, remaining, ".%06ld ", // NOLINT
-                   msg_payload->timestamp.tv_nsec / 1000) >= remaining) {
-        _error("Nanoseconds truncated in process_msg_payload");
+      t->fd = dup(fileno(sink->fp));
+      if (t->fd == -1) {
+        continue;
       }
     }
-  } else {
-    // Make sure timestamp is empty
-    timestamp[0] = '\0';
+    req->num_targets++;
   }
-  // Logfile: the primary artifact. It always carries the configured color and
-  // timestamp markup - which --plain empties and the timestamp options enable -
-  // and, unlike the stdout/stderr streams, keeps that color even when those
-  // streams are not a TTY. It is not flushed per line for performance; errors
-  // that have surfaced are caught here and the logfile is re-checked
-  // definitively at fclose().
-  if (!logfile_broken) {
-    // Clear errno first, then capture it the instant the write reports failure
-    // (via the fprintf return or ferror), before any other call can clobber
-    // it. A failure seen only through the error indicator - which does not set
-    // errno - is reported as EIO. No clearerr(): the sink is marked broken and
-    // skipped from here on.
-    errno = 0;
-    int wrote = fprintf(logfile, "%s%s%s%s%s%s\n", ts_color, timestamp,
-                        reset_color, color, msg_payload->text, reset_color);
-    int err = errno;
-    if (wrote < 0 || ferror(logfile)) {
-      output_write_error("logfile", &logfile_broken, err ? err : EIO);
+  return req;
+}
+
+static void sync_request_free(struct sync_request *req) {
+  for (int i = 0; i < req->num_targets; i++) {
+    if (req->targets[i].fd != -1) {
+      close(req->targets[i].fd);
     }
   }
+  free(req->targets);
+  free(req);
+}
 
-  // stdout/stderr: once a stream has broken, skip it so we neither re-raise
-  // EPIPE nor emit repeated diagnostics for the same dead consumer.
-  int *broken = (stream == stderr) ? &stderr_broken : &stdout_broken;
-  const char *sink = (stream == stderr) ? "stderr" : "stdout";
-  if (!*broken) {
-    errno = 0;
-    int wrote;
-    if (color_to_tty) {
-      wrote = fprintf(stream, "%s%s%s%s%s%s\n", ts_color, timestamp,
-                      reset_color, color, msg_payload->text, reset_color);
+// Force a request's files to stable storage. Returns 0, or the first errno
+// with the failing sink in *failed. With `charge`, for a sync the drain loop
+// itself waits for, the time is added to each sink's --stats blocked time.
+static int sync_request_run(struct sync_request *req, int *failed,
+                            int charge) {
+  int err = 0;
+  for (int i = 0; i < req->num_targets; i++) {
+    struct sync_target *t = &req->targets[i];
+    struct timespec since;
+    if (charge) {
+      clock_gettime(CLOCK_MONOTONIC, &since);
+    }
+    int rc;
+    if (t->ring) {
+      rc = msync(t->ring, sizeof(*t->ring) + (size_t)t->ring->size, MS_SYNC);
     } else {
-      wrote = fprintf(stream, "%s%s\n", timestamp, msg_payload->text);
+#ifdef __APPLE__
+      rc = fsync(t->fd); // macOS has no fdatasync()
+#else
+      rc = fdatasync(t->fd);
+#endif
     }
-    int flush_failed = (fflush(stream) != 0);
-    // Capture errno from the failing fprintf/fflush before ferror() is called.
-    int err = errno;
-    if (wrote < 0 || flush_failed || ferror(stream)) {
-      output_write_error(sink, broken, err ? err : EIO);
+    if (charge) {
+      log_sinks[t->sink].blocked_ns += elapsed_ns(&since);
+    }
+    if (rc == -1 && !err) {
+      err = errno;
+      *failed = t->sink;
+    }
+  }
+  return err;
+}
+
+static void *sync_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&sync_lock);
+  for (;;) {
+    while (!sync_pending && !sync_stop) {
+      pthread_cond_wait(&sync_wake, &sync_lock);
+    }
+    struct sync_request *req = sync_pending;
+    if (!req) {
+      break;
+    }
+    sync_pending = NULL;
+    pthread_mutex_unlock(&sync_lock);
+    int failed = -1;
+    int err = sync_request_run(req, &failed, 0);
+    pthread_mutex_lock(&sync_lock);
+    if (err) {
+      if (!sync_error) {
+        sync_error = err;
+        sync_error_sink = failed;
+      }
+    } else if (req->logged > durable_bytes) {
+      durable_bytes = req->logged;
+    }
+    sync_request_free(req);
+  }
+  pthread_mutex_unlock(&sync_lock);
+  return NULL;
+}
+
+// Report a failure the sync thread recorded, under the --output-error policy
+// of the sink concerned. Call with sync_lock held.
+static void sync_report_error(void) {
+  if (sync_error) {
+    struct log_sink *sink = &log_sinks[sync_error_sink];
+    if (!sink->broken) {
+      output_write_error(sink->name, &sink->broken, sync_error);
+    }
+    sync_error = 0;
+  }
+}
+
+// Start the sync thread for --sync=interval or --sync=bytes. Must run after
+// the workers are forked: fork() and threads do not mix.
+void sync_start(void) {
+  clock_gettime(CLOCK_MONOTONIC, &last_request);
+  if (sync_mode != SYNC_INTERVAL && sync_mode != SYNC_BYTES) {
+    return;
+  }
+  int err = pthread_create(&sync_thread, NULL, sync_main, NULL);
+  if (err != 0) {
+    _warn("cannot start sync thread (%s); syncing at exit only",
+          strerror(err));
+    sync_mode = SYNC_EXIT;
+    return;
+  }
+  sync_thread_started = 1;
+}
+
+static long ms_since(const struct timespec *then) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - then->tv_sec) * 1000 +
+         (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+// How long the drain loop may sleep in poll(): no longer than the time left
+// until logged but unsynced data is due for --sync=interval.
+int sync_poll_timeout(void) {
+  if (sync_mode != SYNC_INTERVAL || logged_bytes == requested_bytes) {
+    return POLL_TIMEOUT_MS;
+  }
+  long left = sync_interval_ms - ms_since(&last_request);
+  return left <= 0 ? 0 : (left < POLL_TIMEOUT_MS ? (int)left : POLL_TIMEOUT_MS);
+}
+
+// Called on each pass of the drain loop: post a sync request once a batch is
+// due, and report on the durability lag.
+void sync_tick(void) {
+  if (!sync_thread_started || logged_bytes == requested_bytes) {
+    return;
+  }
+  if (sync_mode == SYNC_BYTES
+          ? logged_bytes - requested_bytes < sync_threshold
+          : ms_since(&last_request) < sync_interval_ms) {
+    return;
+  }
+  struct sync_request *req = sync_request_new();
+  pthread_mutex_lock(&sync_lock);
+  if (sync_pending) {
+    sync_request_free(sync_pending); // superseded by this one
+  }
+  sync_pending = req;
+  pthread_cond_signal(&sync_wake);
+  off_t durable = durable_bytes;
+  sync_report_error();
+  pthread_mutex_unlock(&sync_lock);
+  requested_bytes = logged_bytes;
+  clock_gettime(CLOCK_MONOTONIC, &last_request);
+  if (logged_bytes - durable > max_sync_lag) {
+    max_sync_lag = logged_bytes - durable;
+  }
+  _debug(1, "sync: %lld of %lld logged bytes durable, lag %lld bytes",
+         (long long)durable, (long long)logged_bytes,
+         (long long)(logged_bytes - durable));
+}
+
+// Before the log files are closed: stop the sync thread, then sync whatever
+// is left. With `report`, apply --output-error to a failure.
+void sync_finish(int report) {
+  if (sync_mode == SYNC_NONE) {
+    return;
+  }
+  if (sync_thread_started) {
+    pthread_mutex_lock(&sync_lock);
+    sync_stop = 1;
+    pthread_cond_signal(&sync_wake);
+    pthread_mutex_unlock(&sync_lock);
+    pthread_join(sync_thread, NULL);
+    sync_thread_started = 0;
+  }
+  if (logged_bytes - durable_bytes > max_sync_lag) {
+    max_sync_lag = logged_bytes - durable_bytes;
+  }
+  struct sync_request *req = sync_request_new();
+  int failed = -1;
+  int err = sync_request_run(req, &failed, show_stats);
+  if (!err) {
+    durable_bytes = req->logged;
+  } else if (!sync_error) {
+    sync_error = err;
+    sync_error_sink = failed;
+  }
+  sync_request_free(req);
+  if (report) {
+    sync_report_error();
+  }
+  _debug(1, "sync: %lld of %lld logged bytes durable at exit",
+         (long long)durable_bytes, (long long)logged_bytes);
+}
+
+// Parse a --sync policy. Returns 0 on success, -1 if it is malformed.
+static int parse_sync(const char *arg) {
+  off_t value;
+  if (strcmp(arg, "none") == 0) {
+    sync_mode = SYNC_NONE;
+  } else if (strcmp(arg, "exit") == 0) {
+    sync_mode = SYNC_EXIT;
+  } else if (strncmp(arg, "interval:", 9) == 0 &&
+             parse_scaled(arg + 9, ms_units, &value) == 0) {
+    sync_mode = SYNC_INTERVAL;
+    sync_interval_ms = (long)value;
+  } else if (strncmp(arg, "bytes:", 6) == 0 &&
+             parse_scaled(arg + 6, size_units, &value) == 0) {
+    sync_mode = SYNC_BYTES;
+    sync_threshold = value;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// --stats: note the high-water marks of `stream`'s queue, after lines have
+// been queued on it.
+static void stats_queued(int stream, int queuelen, size_t queued_bytes) {
+  struct stream_stats *st = &stream_stats[stream];
+  if (queuelen > st->max_queuelen) {
+    st->max_queuelen = queuelen;
+  }
+  if (queued_bytes > st->max_queued_bytes) {
+    st->max_queued_bytes = queued_bytes;
+  }
+}
+
+// --stats: report the counters to stderr, at exit or on SIGUSR1. Time a
+// worker spent blocked means t3 itself was falling behind the command; time
+// a sink spent blocked means that sink's consumer was falling behind t3. For
+// a log file that is every call the drain loop waits on: writes, the flushes
+// and syncs of --sync (but not the background fdatasync()s), releasing the
+// cache for --log-nocache, rotation, and closing. --listen subscribers never
+// block the loop, only at exit while the last records go out; one that
+// falls behind is dropped instead, and counted.
+static void stats_report(const char *when) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  tty_printf("t3: stats %s, %.3fs in\n", when,
+             (double)timespec_ms_delta(&now, &start_timestamp) / 1000);
+  const int queuelen[2] = {stdout_queuelen, stderr_queuelen};
+  const size_t queued_bytes[2] = {stdout_queued_bytes, stderr_queued_bytes};
+  for (int i = 0; i < 2; i++) {
+    const struct stream_stats *st = &stream_stats[i];
+    tty_printf("t3:   %s queue: %d lines, %zu bytes (peak %d lines, %zu bytes);"
+               " worker blocked %.3fs\n",
+               i ? "stderr" : "stdout", queuelen[i], queued_bytes[i],
+               st->max_queuelen, st->max_queued_bytes,
+               (double)__atomic_load_n(&st->blocked_ns, __ATOMIC_RELAXED) /
+                   1e9);
+  }
+  for (int i = 0; i < 2; i++) {
+    const struct tty_out *out = &tty_outs[i];
+    tty_printf("t3:   sink %s: blocked %.3fs, backlog %zu bytes (peak %zu)\n",
+               out->name, (double)out->blocked_ns / 1e9, out->backlog.len,
+               out->max_backlog);
+  }
+  for (int i = 0; i < num_log_sinks; i++) {
+    const struct log_sink *sink = &log_sinks[i];
+    tty_printf("t3:   sink %s: blocked %.3fs\n", sink->name,
+               (double)sink->blocked_ns / 1e9);
+  }
+  if (listen_path) {
+    size_t queued = 0;
+    for (int i = 0; i < num_subscribers; i++) {
+      queued += subscribers[i].pending.len;
+    }
+    tty_printf("t3:   sink listen: %d subscribers, %zu bytes queued (peak %zu),"
+               " %d dropped; blocked %.3fs\n",
+               num_subscribers, queued, max_subscriber_queued,
+               subscribers_dropped, (double)listen_blocked_ns / 1e9);
+  }
+  if (sync_mode != SYNC_NONE) {
+    pthread_mutex_lock(&sync_lock);
+    off_t durable = durable_bytes;
+    pthread_mutex_unlock(&sync_lock);
+    if (logged_bytes - durable > max_sync_lag) {
+      max_sync_lag = logged_bytes - durable;
     }
+    tty_printf("t3:   sync: %lld of %lld logged bytes durable, lag %lld bytes"
+               " (peak %lld)\n",
+               (long long)durable, (long long)logged_bytes,
+               (long long)(logged_bytes - durable), (long long)max_sync_lag);
   }
 }
 
 int main(int argc, char *argv[]) {
+  main_pid = getpid();
+  main_thread = pthread_self();
   int opt;
   int option_index = 0;
   const char *logfile_name = NULL;
@@ -745,9 +3847,41 @@ int main(int argc, char *argv[]) {
   int debug_mode = 0;
   int append_mode = 0;
   int ignore_interrupts = 0;
+  int pty_mode = 0;
+  int use_threads = 0;
+  enum log_format log_format = LOG_FORMAT_TEXT;
+  off_t ring_size = 0;
 
-  // Long option without a short equivalent.
-  enum { OPT_OUTPUT_ERROR = 1000 };
+  // Long options without a short equivalent.
+  enum {
+    OPT_OUTPUT_ERROR = 1000,
+    OPT_PTY,
+    OPT_STRIP_ANSI,
+    OPT_LOG_STRIP_ANSI,
+    OPT_LOG_COMPACT_CR,
+    OPT_LOG_FORMAT,
+    OPT_LOG,
+    OPT_LISTEN,
+    OPT_ROTATE_SIZE,
+    OPT_ROTATE_INTERVAL,
+    OPT_ROTATE_COMPRESS,
+    OPT_RING,
+    OPT_RING_READ,
+    OPT_SYNC,
+    OPT_LOG_NOCACHE,
+    OPT_COLLAPSE_REPEATS,
+    OPT_HIGHLIGHT,
+    OPT_GREP_OUT,
+    OPT_TTY_MAX_RATE,
+    OPT_PARTIAL_FLUSH,
+    OPT_STATS,
+    OPT_THREADS,
+    OPT_CPUS,
+    OPT_NICE,
+    OPT_SCHED,
+    OPT_NUMA_LOCAL,
+    OPT_HUGEPAGES
+  };
 
   static struct option long_options[] = {
       {"append", no_argument, 0, 'a'},
@@ -758,10 +3892,36 @@ int main(int argc, char *argv[]) {
       {"help", no_argument, 0, 'h'},
       {"ignore-interrupts", no_argument, 0, 'i'},
       {"light", no_argument, 0, 'l'},
+      {"listen", required_argument, 0, OPT_LISTEN},
+      {"log", required_argument, 0, OPT_LOG},
+      {"log-format", required_argument, 0, OPT_LOG_FORMAT},
+      {"log-nocache", no_argument, 0, OPT_LOG_NOCACHE},
+      {"log-strip-ansi", no_argument, 0, OPT_LOG_STRIP_ANSI},
+      {"log-compact-cr", no_argument, 0, OPT_LOG_COMPACT_CR},
       {"outcolor", required_argument, 0, 'o'},
       {"output-error", optional_argument, 0, OPT_OUTPUT_ERROR},
       {"plain", no_argument, 0, 'p'},
+      {"pty", no_argument, 0, OPT_PTY},
+      {"collapse-repeats", no_argument, 0, OPT_COLLAPSE_REPEATS},
+      {"highlight", required_argument, 0, OPT_HIGHLIGHT},
+      {"grep-out", required_argument, 0, OPT_GREP_OUT},
+      {"tty-max-rate", required_argument, 0, OPT_TTY_MAX_RATE},
+      {"partial-flush", required_argument, 0, OPT_PARTIAL_FLUSH},
+      {"stats", no_argument, 0, OPT_STATS},
+      {"threads", no_argument, 0, OPT_THREADS},
+      {"cpus", required_argument, 0, OPT_CPUS},
+      {"nice", required_argument, 0, OPT_NICE},
+      {"sched", required_argument, 0, OPT_SCHED},
+      {"numa-local", no_argument, 0, OPT_NUMA_LOCAL},
+      {"hugepages", no_argument, 0, OPT_HUGEPAGES},
+      {"rotate-size", required_argument, 0, OPT_ROTATE_SIZE},
+      {"rotate-interval", required_argument, 0, OPT_ROTATE_INTERVAL},
+      {"rotate-compress", no_argument, 0, OPT_ROTATE_COMPRESS},
+      {"ring", required_argument, 0, OPT_RING},
+      {"ring-read", required_argument, 0, OPT_RING_READ},
+      {"sync", required_argument, 0, OPT_SYNC},
       {"relative", no_argument, 0, 'r'},
+      {"strip-ansi", no_argument, 0, OPT_STRIP_ANSI},
       {"ts", no_argument, 0, 't'},
       {"version", no_argument, 0, 'v'},
       {"debug", no_argument, 0, 'x'},
@@ -806,6 +3966,152 @@ int main(int argc, char *argv[]) {
         usage(EXIT_FAILURE);
       }
       break;
+    case OPT_PTY:
+      pty_mode = 1;
+      break;
+    case OPT_STRIP_ANSI:
+      strip_ansi_tty = 1;
+      break;
+    case OPT_LOG_STRIP_ANSI:
+      strip_ansi_log = 1;
+      break;
+    case OPT_LOG_COMPACT_CR:
+      compact_cr_log = 1;
+      break;
+    case OPT_LOG_FORMAT:
+      if (parse_log_format(optarg, &log_format) != 0) {
+        fprintf(stderr, "Error: invalid --log-format '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      break;
+    case OPT_ROTATE_SIZE:
+      if (parse_scaled(optarg, size_units, &rotate_size) != 0) {
+        fprintf(stderr, "Error: invalid --rotate-size '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      break;
+    case OPT_ROTATE_INTERVAL: {
+      off_t seconds;
+      if (parse_scaled(optarg, time_units, &seconds) != 0) {
+        fprintf(stderr, "Error: invalid --rotate-interval '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      rotate_interval = (time_t)seconds;
+      break;
+    }
+    case OPT_ROTATE_COMPRESS:
+      rotate_compress = 1;
+      break;
+    case OPT_RING:
+      if (parse_scaled(optarg, size_units, &ring_size) != 0) {
+        fprintf(stderr, "Error: invalid --ring '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      break;
+    case OPT_HIGHLIGHT:
+    case OPT_GREP_OUT:
+      if (add_line_rule(optarg, opt == OPT_HIGHLIGHT) != 0) {
+        fprintf(stderr, "Error: invalid --%s '%s'\n",
+                opt == OPT_HIGHLIGHT ? "highlight" : "grep-out", optarg);
+        usage(EXIT_FAILURE);
+      }
+      break;
+    case OPT_TTY_MAX_RATE: {
+      char *end;
+      long rate = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || rate <= 0 || rate > 1000000000) {
+        fprintf(stderr, "Error: invalid --tty-max-rate '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      tty_max_rate = rate;
+      break;
+    }
+    case OPT_PARTIAL_FLUSH: {
+      off_t ms;
+      if (parse_scaled(optarg, ms_units, &ms) != 0 || ms > INT_MAX) {
+        fprintf(stderr, "Error: invalid --partial-flush '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      partial_flush_ms = (long)ms;
+      break;
+    }
+    case OPT_STATS:
+      show_stats = 1;
+      break;
+    case OPT_THREADS:
+      use_threads = 1;
+      break;
+    case OPT_HUGEPAGES:
+      use_hugepages = 1;
+      break;
+    case OPT_CPUS:
+#ifdef CPU_SETSIZE
+      if (parse_cpu_list(optarg, &sched_cpus) != 0) {
+        fprintf(stderr, "Error: invalid --cpus '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      sched_cpus_set = 1;
+      break;
+#else
+      fprintf(stderr, "Error: --cpus is not supported on this system\n");
+      exit(EXIT_FAILURE);
+#endif
+    case OPT_NICE: {
+      char *end;
+      long value = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || value < 0 || value > 19) {
+        fprintf(stderr, "Error: invalid --nice '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      sched_nice = (int)value;
+      break;
+    }
+    case OPT_SCHED:
+#ifdef SCHED_BATCH
+      if (strcmp(optarg, "batch") == 0) {
+        sched_policy = SCHED_BATCH;
+      } else if (strcmp(optarg, "idle") == 0) {
+        sched_policy = SCHED_IDLE;
+      } else {
+        fprintf(stderr, "Error: invalid --sched '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      break;
+#else
+      fprintf(stderr, "Error: --sched is not supported on this system\n");
+      exit(EXIT_FAILURE);
+#endif
+    case OPT_NUMA_LOCAL:
+#ifdef CPU_SETSIZE
+      sched_numa_local = 1;
+      break;
+#else
+      fprintf(stderr, "Error: --numa-local is not supported on this system\n");
+      exit(EXIT_FAILURE);
+#endif
+    case OPT_COLLAPSE_REPEATS:
+      collapse_repeats = 1;
+      break;
+    case OPT_LOG_NOCACHE:
+      log_nocache = 1;
+      break;
+    case OPT_SYNC:
+      if (parse_sync(optarg) != 0) {
+        fprintf(stderr, "Error: invalid --sync '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      break;
+    case OPT_RING_READ:
+      exit(ring_read(optarg) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    case OPT_LISTEN:
+      listen_path = optarg;
+      break;
+    case OPT_LOG:
+      if (add_log_sink_spec(optarg) != 0) {
+        fprintf(stderr, "Error: invalid --log '%s'\n", optarg);
+        usage(EXIT_FAILURE);
+      }
+      break;
     case 'f':
       forcecolor_mode = 1;
       break;
@@ -872,12 +4178,32 @@ int main(int argc, char *argv[]) {
     usage(EXIT_FAILURE);
   }
 
+  // --plain disables all color, highlighting included; --grep-out still
+  // applies.
+  if (plain_mode) {
+    for (int i = 0; i < num_line_rules; i++) {
+      if (line_rules[i].color) {
+        line_rules[i].color = "";
+      }
+    }
+  }
+  build_line_matcher();
+
+  if (ring_size && (rotate_size || rotate_interval)) {
+    fprintf(stderr, "Error: Option --ring cannot be combined with log "
+                    "rotation.\n");
+    usage(EXIT_FAILURE);
+  }
+
   if (optind >= argc) {
     fprintf(stderr, "Expected logfile and command after options\n");
     usage(EXIT_FAILURE);
   }
 
   logfile_name = argv[optind++];
+  add_log_sink("logfile", logfile_name, log_format,
+               STREAM_STDOUT | STREAM_STDERR);
+  log_sinks[num_log_sinks - 1].ring_size = ring_size;
   if (optind >= argc) {
     fprintf(stderr, "Expected command after logfile\n");
     usage(EXIT_FAILURE);
@@ -891,16 +4217,29 @@ int main(int argc, char *argv[]) {
     color_to_tty = 0;
   }
 
+  // The command's stdout and stderr are plain pipes, or with --pty the slave
+  // ends of two pseudo-terminals. open_pty() fills its array in pipe(2)'s
+  // layout, so the rest of main() need not care which it got.
   int stdout_pipe[2], stderr_pipe[2], stdout_msg_pipe[2], stderr_msg_pipe[2];
-  if (pipe(stdout_pipe) == -1 || pipe(stderr_pipe) == -1 ||
-      pipe(stdout_msg_pipe) == -1 || pipe(stderr_msg_pipe) == -1) {
+  if (pty_mode) {
+    if (open_pty(stdout_pipe) == -1 || open_pty(stderr_pipe) == -1) {
+      perror("Error creating pseudo-terminals");
+      return EXIT_FAILURE;
+    }
+  } else if (pipe(stdout_pipe) == -1 || pipe(stderr_pipe) == -1) {
+    perror("Error creating pipes");
+    return EXIT_FAILURE;
+  }
+  if (pipe(stdout_msg_pipe) == -1 || pipe(stderr_msg_pipe) == -1) {
     perror("Error creating pipes");
     return EXIT_FAILURE;
   }
 
-  FILE *logfile = fopen(logfile_name, append_mode ? "a" : "w");
-  if (!logfile) {
-    fprintf(stderr, "Error opening logfile '%s': %s\n", logfile_name,
+  if (open_log_sinks(append_mode) != 0) {
+    return EXIT_FAILURE;
+  }
+  if (listen_path && listen_open(listen_path) == -1) {
+    fprintf(stderr, "Error listening on '%s': %s\n", listen_path,
             strerror(errno));
     return EXIT_FAILURE;
   }
@@ -921,122 +4260,203 @@ int main(int argc, char *argv[]) {
     set_signal(SIGINT, SIG_IGN);
   }
 
-  pid_t stdout_worker = fork();
-  if (stdout_worker == 0) {
-    // Child process: handle stdout
-    close(stdout_pipe[1]);     // Close write end of stdout pipe
-    close(stderr_pipe[0]);     // Close unused read end of stderr pipe
-    close(stderr_pipe[1]);     // Close unused write end of stderr pipe
-    close(stdout_msg_pipe[0]); // Close read end of stdout message pipe
-    close(stderr_msg_pipe[0]); // Close unused read end of stderr message pipe
-    close(stderr_msg_pipe[1]); // Close unused write end of stderr message pipe
-    timestamp_and_send(stdout_msg_pipe[1], stdout_pipe[0], "stdout");
-    close(stdout_pipe[0]);
-    close(stdout_msg_pipe[1]);
-    exit(EXIT_SUCCESS);
+  // Start both timestamp workers. There is no synchronous handshake here:
+  // each worker's "<prefix> started" frame is validated when the drain loop
+  // reads it (see struct framereader), so the command is launched without
+  // waiting on a round-trip through either message pipe. With --threads they
+  // are reader threads instead, and the message pipes carry only their
+  // wake-ups.
+  pid_t stdout_worker = -1, stderr_worker = -1;
+  static struct reader_thread stdout_thread, stderr_thread;
+  sched_prepare();
+  // With --stats, SIGUSR1 asks for a snapshot of the counters. The handler
+  // only sets a flag, which the drain loop acts on: it interrupts the loop's
+  // poll(), and SA_RESTART keeps it from cutting other calls short. It is
+  // installed before any worker starts, so a SIGUSR1 sent early, or to every
+  // t3 process, kills nothing: the reader threads block it, the worker
+  // processes ignore it, and the command gets the default back at exec.
+  if (show_stats) {
+    stats_init();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+      perror("sigaction");
+      exit(EXIT_FAILURE);
+    }
   }
+  if (use_threads) {
+    int err = reader_thread_start(&stdout_thread, stdout_pipe[0],
+                                  stdout_msg_pipe,
+                                  show_stats ? &stream_stats[0].blocked_ns
+                                             : NULL);
+    if (err == 0) {
+      err = reader_thread_start(&stderr_thread, stderr_pipe[0],
+                                stderr_msg_pipe,
+                                show_stats ? &stream_stats[1].blocked_ns
+                                           : NULL);
+    }
+    if (err != 0) {
+      fprintf(stderr, "Error starting reader thread: %s\n", strerror(err));
+      return EXIT_FAILURE;
+    }
+  } else {
+    stdout_worker = fork();
+    if (stdout_worker == 0) {
+      // Child process: handle stdout
+      close(stdout_pipe[1]);     // Close write end of stdout pipe
+      close(stderr_pipe[0]);     // Close unused read end of stderr pipe
+      close(stderr_pipe[1]);     // Close unused write end of stderr pipe
+      close(stdout_msg_pipe[0]); // Close read end of stdout message pipe
+      close(stderr_msg_pipe[0]); // Close unused read end of stderr message pipe
+      close(stderr_msg_pipe[1]); // Close unused write end of stderr msg pipe
+      if (show_stats) {
+        set_signal(SIGUSR1, SIG_IGN);
+      }
+      sched_apply("stdout worker");
+      timestamp_and_send(stdout_msg_pipe[1], stdout_pipe[0], "stdout");
+      close(stdout_pipe[0]);
+      close(stdout_msg_pipe[1]);
+      exit(EXIT_SUCCESS);
+    }
 
-  // Verify that the stdout worker process is online and ready
-  if (await_worker(stdout_msg_pipe[0], "stdout") != 0) {
-    return EXIT_FAILURE;
-  }
-  _debug(2, "confirmed stdout worker process [%d] is online and ready",
-         stdout_worker);
-
-  pid_t stderr_worker = fork();
-  if (stderr_worker == 0) {
-    // Child process: handle stderr
-    close(stderr_pipe[1]);     // Close write end of stderr pipe
-    close(stdout_pipe[0]);     // Close unused read end of stdout pipe
-    close(stdout_pipe[1]);     // Close unused write end of stdout pipe
-    close(stderr_msg_pipe[0]); // Close read end of stderr message pipe
-    close(stdout_msg_pipe[0]); // Close unused read end of stdout message pipe
-    close(stdout_msg_pipe[1]); // Close unused write end of stdout message pipe
-    timestamp_and_send(stderr_msg_pipe[1], stderr_pipe[0], "stderr");
-    close(stderr_pipe[0]);
-    close(stderr_msg_pipe[1]);
-    exit(EXIT_SUCCESS);
-  }
-
-  // Verify that the stderr worker process is online and ready
-  if (await_worker(stderr_msg_pipe[0], "stderr") != 0) {
-    return EXIT_FAILURE;
+    stderr_worker = fork();
+    if (stderr_worker == 0) {
+      // Child process: handle stderr
+      close(stderr_pipe[1]);     // Close write end of stderr pipe
+      close(stdout_pipe[0]);     // Close unused read end of stdout pipe
+      close(stdout_pipe[1]);     // Close unused write end of stdout pipe
+      close(stderr_msg_pipe[0]); // Close read end of stderr message pipe
+      close(stdout_msg_pipe[0]); // Close unused read end of stdout message pipe
+      close(stdout_msg_pipe[1]); // Close unused write end of stdout msg pipe
+      if (show_stats) {
+        set_signal(SIGUSR1, SIG_IGN);
+      }
+      sched_apply("stderr worker");
+      timestamp_and_send(stderr_msg_pipe[1], stderr_pipe[0], "stderr");
+      close(stderr_pipe[0]);
+      close(stderr_msg_pipe[1]);
+      exit(EXIT_SUCCESS);
+    }
+
+    if (stdout_worker == -1 || stderr_worker == -1) {
+      perror("Error forking worker process");
+      return EXIT_FAILURE;
+    }
   }
-  _debug(2, "confirmed stderr worker process [%d] is online and ready",
-         stderr_worker);
 
-  pid_t pid = fork();
-  if (pid == -1) {
-    perror("Error forking process");
+  // Launch the command with posix_spawnp(), which C libraries implement with
+  // vfork() or clone(CLONE_VFORK): unlike fork() it does not duplicate t3's
+  // address space only to throw it away at exec. The file actions replay what
+  // a forked child would do by hand - drop every pipe end the command must
+  // not hold, then move the write ends onto its stdout and stderr.
+  //
+  // If --ignore-interrupts set SIGINT to SIG_IGN in the parent, the spawn
+  // attributes restore the default in the command so it still responds to a
+  // Ctrl-C. Only undo what t3 itself changed: when the option is off we leave
+  // the inherited disposition untouched, so a SIG_IGN inherited from t3's own
+  // parent (e.g. when t3 was started in the background) still propagates.
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  if (ignore_interrupts) {
+    sigaddset(&default_signals, SIGINT);
+  }
+  if (posix_spawn_file_actions_init(&actions) != 0 ||
+      posix_spawn_file_actions_addclose(&actions, stdout_pipe[0]) != 0 ||
+      posix_spawn_file_actions_addclose(&actions, stderr_pipe[0]) != 0 ||
+      posix_spawn_file_actions_addclose(&actions, stdout_msg_pipe[0]) != 0 ||
+      posix_spawn_file_actions_addclose(&actions, stderr_msg_pipe[0]) != 0 ||
+      posix_spawn_file_actions_addclose(&actions, stdout_msg_pipe[1]) != 0 ||
+      posix_spawn_file_actions_addclose(&actions, stderr_msg_pipe[1]) != 0 ||
+      posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1],
+                                       STDOUT_FILENO) != 0 ||
+      posix_spawn_file_actions_adddup2(&actions, stderr_pipe[1],
+                                       STDERR_FILENO) != 0 ||
+      posix_spawn_file_actions_addclose(&actions, stdout_pipe[1]) != 0 ||
+      posix_spawn_file_actions_addclose(&actions, stderr_pipe[1]) != 0 ||
+      posix_spawnattr_init(&attr) != 0 ||
+      posix_spawnattr_setsigdefault(&attr, &default_signals) != 0 ||
+      posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF) != 0) {
+    perror("Error preparing to spawn command");
     return EXIT_FAILURE;
   }
 
-  if (pid == 0) {
-    // Child process: execute the command
-    close(stdout_pipe[0]);     // Close read end of stdout pipe
-    close(stderr_pipe[0]);     // Close read end of stderr pipe
-    close(stdout_msg_pipe[0]); // Close read end of stdout message pipe
-    close(stderr_msg_pipe[0]); // Close read end of stderr message pipe
-    close(stdout_msg_pipe[1]); // Close write end of stdout message pipe
-    close(stderr_msg_pipe[1]); // Close write end of stderr message pipe
-
-    dup2(stdout_pipe[1], STDOUT_FILENO);
-    dup2(stderr_pipe[1], STDERR_FILENO);
-
-    close(stdout_pipe[1]); // Close write end of stdout pipe
-    close(stderr_pipe[1]); // Close write end of stderr pipe
-
-    // If --ignore-interrupts set SIGINT to SIG_IGN in the parent, restore the
-    // default in the command so it still responds to a Ctrl-C. Only undo what
-    // t3 itself changed: when the option is off we leave the inherited
-    // disposition untouched, so a SIG_IGN inherited from t3's own parent
-    // (e.g. when t3 was started in the background) still propagates.
-    if (ignore_interrupts) {
-      set_signal(SIGINT, SIG_DFL);
-    }
-
-    execvp(command, command_args);
-
-    // If execvp fails
-    perror("Error executing command");
-    exit(EXIT_FAILURE);
+  // A command that cannot be executed is reported here rather than by the
+  // child. t3 still runs its normal teardown - the workers see end-of-file
+  // once the pipe write ends are closed below - and exits with failure.
+  pid_t pid;
+  int spawn_error =
+      posix_spawnp(&pid, command, &actions, &attr, command_args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (spawn_error != 0) {
+    fprintf(stderr, "Error executing command: %s\n", strerror(spawn_error));
+    pid = -1;
   }
 
-  // Parent process
+  // Only now, with the command running under t3's original scheduling, does
+  // the main thread take on --cpus, --nice and --sched.
+  sched_apply("t3 process");
+
+  // Parent process: the command and workers hold the ends they need
   close(stdout_pipe[1]);     // Close write end of stdout pipe
   close(stderr_pipe[1]);     // Close write end of stderr pipe
-  close(stdout_msg_pipe[1]); // Close write end of stdout message pipe
-  close(stderr_msg_pipe[1]); // Close write end of stderr message pipe
+  if (!use_threads) {
+    close(stdout_msg_pipe[1]); // Close write end of stdout message pipe
+    close(stderr_msg_pipe[1]); // Close write end of stderr message pipe
+  }
 
   // Ignore SIGPIPE so that a write to a closed consumer (e.g. the stdout of
   // `t3 log -- cmd | head`) returns EPIPE for --output-error to handle, rather
   // than silently killing t3. This is set here in the parent, after the
-  // command child has been forked and exec'd, so the command keeps the default
-  // SIGPIPE disposition; it applies for the rest of t3's own lifetime.
+  // command has been spawned, so the command keeps the default SIGPIPE
+  // disposition; it applies for the rest of t3's own lifetime.
   set_signal(SIGPIPE, SIG_IGN);
 
-  struct pollfd pfds[2];
+  // The two message pipes, the --listen socket (-1, and so ignored by
+  // poll(), when there is none), and stdout/stderr while they have a backlog.
+  struct pollfd pfds[5];
   nfds_t num_open_fds = 2; // We start with two open file descriptors
   pfds[0].fd = stdout_msg_pipe[0];
   pfds[0].events = POLLIN | POLLHUP;
   pfds[1].fd = stderr_msg_pipe[0];
   pfds[1].events = POLLIN | POLLHUP;
+  pfds[2].fd = listen_fd;
+  pfds[2].events = POLLIN;
 
   struct framereader stdout_reader, stderr_reader;
-  framereader_init(&stdout_reader, stdout_msg_pipe[0]);
-  framereader_init(&stderr_reader, stderr_msg_pipe[0]);
+  if (use_threads) {
+    framereader_init_ring(&stdout_reader, &stdout_thread.ring);
+    framereader_init_ring(&stderr_reader, &stderr_thread.ring);
+  } else {
+    framereader_init(&stdout_reader, stdout_msg_pipe[0], "stdout");
+    framereader_init(&stderr_reader, stderr_msg_pipe[0], "stderr");
+  }
+
+  sync_start();
 
   int loopcount = 0;
-  long ms_delta = 0;
-  while (!output_error_fatal &&
+  while (!output_error_fatal && !worker_failed &&
          (stdout_head || stderr_head || (num_open_fds > 0))) {
     _debug(2, "loop %d", loopcount++);
+    if (stats_requested) {
+      stats_requested = 0;
+      stats_report("snapshot");
+    }
 
     // Check for new input on the message pipes
     if (num_open_fds > 0) {
-      int poll_result = poll(pfds, 2, POLL_TIMEOUT_MS); // Wait for the next
-                                                        // message, or time out
-                                                        // to flush aged lines
+      // Wait for the next message, or time out to flush aged lines (and
+      // any log data due for --sync=interval, lines elided from the terminal
+      // by --tty-max-rate, or lines forwarded by --partial-flush).
+      tty_outs_poll_events(&pfds[3]);
+      int poll_result = poll(
+          pfds, 5,
+          partial_poll_timeout(tty_rate_poll_timeout(sync_poll_timeout())));
       if (poll_result == -1) {
         if (errno == EINTR)
           continue;
@@ -1068,7 +4488,11 @@ int main(int argc, char *argv[]) {
           while ((msg_payload = framereader_next(&stdout_reader)) != NULL) {
             struct message *msg = xmalloc(sizeof(struct message));
             msg->msg_payload = msg_payload;
-            push(&stdout_head, &stdout_tail, msg, &stdout_queuelen);
+            push(&stdout_head, &stdout_tail, msg, &stdout_queuelen,
+                 &stdout_queued_bytes);
+          }
+          if (show_stats) {
+            stats_queued(0, stdout_queuelen, stdout_queued_bytes);
           }
           if (rc <= 0) {
             // EOF or error: stop watching for input. The POLLHUP branch
@@ -1089,11 +4513,19 @@ int main(int argc, char *argv[]) {
             _warn("stdout worker ended mid-frame; %zu trailing byte(s) "
                   "discarded",
                   framereader_pending(&stdout_reader));
+          } else if (stdout_reader.handshake) {
+            fprintf(stderr, "Error: stdout worker closed before completing "
+                            "handshake\n");
+            worker_failed = 1;
           }
           close(stdout_msg_pipe[0]);
           pfds[0].fd = -1; // Ignore this file descriptor in future polls
           num_open_fds--;
-          waitpid(stdout_worker, NULL, WNOHANG);
+          if (use_threads) {
+            pthread_join(stdout_thread.thread, NULL);
+          } else {
+            waitpid(stdout_worker, NULL, WNOHANG);
+          }
         }
         if (pfds[1].revents & POLLIN) {
           _debug(2, "detected input on stderr_msg_pipe[0]");
@@ -1103,7 +4535,11 @@ int main(int argc, char *argv[]) {
           while ((msg_payload = framereader_next(&stderr_reader)) != NULL) {
             struct message *msg = xmalloc(sizeof(struct message));
             msg->msg_payload = msg_payload;
-            push(&stderr_head, &stderr_tail, msg, &stderr_queuelen);
+            push(&stderr_head, &stderr_tail, msg, &stderr_queuelen,
+                 &stderr_queued_bytes);
+          }
+          if (show_stats) {
+            stats_queued(1, stderr_queuelen, stderr_queued_bytes);
           }
           if (rc <= 0) {
             // EOF or error: stop watching for input. The POLLHUP branch
@@ -1124,11 +4560,25 @@ int main(int argc, char *argv[]) {
             _warn("stderr worker ended mid-frame; %zu trailing byte(s) "
                   "discarded",
                   framereader_pending(&stderr_reader));
+          } else if (stderr_reader.handshake) {
+            fprintf(stderr, "Error: stderr worker closed before completing "
+                            "handshake\n");
+            worker_failed = 1;
           }
           close(stderr_msg_pipe[0]);
           pfds[1].fd = -1; // Ignore this file descriptor in future polls
           num_open_fds--;
-          waitpid(stderr_worker, NULL, WNOHANG);
+          if (use_threads) {
+            pthread_join(stderr_thread.thread, NULL);
+          } else {
+            waitpid(stderr_worker, NULL, WNOHANG);
+          }
+        }
+        if (pfds[2].revents & POLLIN) {
+          listen_accept();
+        }
+        if (pfds[3].revents || pfds[4].revents) {
+          tty_outs_flush();
         }
       }
     }
@@ -1140,77 +4590,40 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    // Drain message queues (stop early if a fatal write error has fired).
-    while ((stdout_head || stderr_head) && !output_error_fatal) {
-      _debug(
-          1,
-          "stdout/stderr queuelen = %d/%d, stdout_head = %p stderr_head = %p",
-          stdout_queuelen, stderr_queuelen, stdout_head, stderr_head);
-      struct message *stdout_ready = NULL;
-      struct message *stderr_ready = NULL;
-
-      if (num_open_fds > 0) {
-        // Create pointers to the head of each of the queues, but only
-        // if they are not too new.
-        if (stdout_head) {
-          ms_delta = timespec_ms_delta(&current_time,
-                                       &stdout_head->msg_payload->timestamp);
-          if (ms_delta >= MESSAGE_HOLD_MS) {
-            stdout_ready = stdout_head;
-          } else {
-            _debug(2, "message on stdout not ready to send after only %ldms",
-                   ms_delta);
-          }
-        }
-        if (stderr_head) {
-          ms_delta = timespec_ms_delta(&current_time,
-                                       &stderr_head->msg_payload->timestamp);
-          if (ms_delta >= MESSAGE_HOLD_MS) {
-            stderr_ready = stderr_head;
-          } else {
-            _debug(2, "message on stderr not ready to send after only %ldms",
-                   ms_delta);
-          }
-        }
-      } else {
-        // If the message pipes are closed, go ahead and process the
-        // remaining messages irrespective of their age.
-        stdout_ready = stdout_head;
-        stderr_ready = stderr_head;
-      }
-
-      // Process whichever message is older.
-      if (stdout_ready && stderr_ready) {
-        // Compare timestamps to determine which to write first
-        if (timespec_cmp(&stdout_ready->msg_payload->timestamp,
-                         &stderr_ready->msg_payload->timestamp) <= 0) {
-          process_msg_payload(stdout, logfile, out_color,
-                              stdout_ready->msg_payload);
-          shift(&stdout_head, &stdout_tail, &stdout_queuelen);
-        } else {
-          process_msg_payload(stderr, logfile, err_color,
-                              stderr_ready->msg_payload);
-          shift(&stderr_head, &stderr_tail, &stderr_queuelen);
-        }
-      } else if (stdout_ready) {
-        // Write stdout message if only stdout is ready
-        process_msg_payload(stdout, logfile, out_color,
-                            stdout_ready->msg_payload);
-        shift(&stdout_head, &stdout_tail, &stdout_queuelen);
-      } else if (stderr_ready) {
-        // Write stderr message if only stderr is ready
-        process_msg_payload(stderr, logfile, err_color,
-                            stderr_ready->msg_payload);
-        shift(&stderr_head, &stderr_tail, &stderr_queuelen);
-      } else {
-        break;
-      }
-    }
+    // Drain message queues. While the message pipes are open, only lines
+    // that have aged past the hold window are emitted; once both are closed,
+    // everything left is flushed irrespective of age.
+    drain_queues(out_color, err_color, &current_time, num_open_fds > 0);
+    subscribers_flush();
+    log_sinks_tick();
+    sync_tick();
   }
 
   framereader_free(&stdout_reader);
   framereader_free(&stderr_reader);
 
+  if (worker_failed) {
+    // A worker's message stream cannot be trusted, so neither can anything
+    // still to come from it. Stop the command and the workers and reap them,
+    // then close the log files and the --listen socket as on any other exit.
+    if (pid != -1) {
+      kill(pid, SIGTERM);
+    }
+    if (!use_threads) {
+      kill(stdout_worker, SIGTERM);
+      kill(stderr_worker, SIGTERM);
+      waitpid(stdout_worker, NULL, 0);
+      waitpid(stderr_worker, NULL, 0);
+    }
+    if (pid != -1) {
+      waitpid(pid, NULL, 0);
+    }
+    sync_finish(0);
+    close_log_sinks(0);
+    listen_close();
+    return EXIT_FAILURE;
+  }
+
   if (output_error_fatal) {
     // A fatal --output-error policy fired mid-drain. Close the message-pipe
     // read ends; the next write from a worker to its now-reader-less pipe
@@ -1227,38 +4640,47 @@ int main(int argc, char *argv[]) {
     if (pfds[1].fd != -1) {
       close(stderr_msg_pipe[0]);
     }
-    if (!logfile_broken) {
-      fflush(logfile);
+    sync_finish(0);
+    close_log_sinks(0);
+    listen_close();
+    if (show_stats) {
+      stats_report("at exit");
     }
-    fclose(logfile);
     return EXIT_FAILURE;
   }
 
   // Reap the timestamp workers. They have closed their pipes (POLLHUP) by the
   // time we get here; a blocking wait collects them so they do not linger as
   // zombies. ECHILD (already reaped via the WNOHANG calls above) is harmless.
-  waitpid(stdout_worker, NULL, 0);
-  waitpid(stderr_worker, NULL, 0);
+  if (!use_threads) {
+    waitpid(stdout_worker, NULL, 0);
+    waitpid(stderr_worker, NULL, 0);
+  }
 
   // Wait for child command process to complete
-  int status;
-  waitpid(pid, &status, 0);
-
-  // Flush and close the logfile, applying the --output-error policy to any
-  // deferred write error (e.g. a full disk) or a close(2) failure (e.g. on a
-  // networked filesystem) that only surfaces now.
-  errno = 0;
-  if (!logfile_broken && (fflush(logfile) != 0 || ferror(logfile))) {
-    output_write_error("logfile", &logfile_broken, errno ? errno : EIO);
+  int status = 0;
+  if (pid != -1) {
+    waitpid(pid, &status, 0);
   }
-  errno = 0;
-  if (fclose(logfile) != 0 && !logfile_broken) {
-    output_write_error("logfile", &logfile_broken, errno ? errno : EIO);
+
+  // Flush and close the log files, applying the --output-error policy to any
+  // write error that only surfaces now.
+  sync_finish(1);
+  close_log_sinks(1);
+  listen_close();
+  tty_outs_finish();
+  reap_compressors(1);
+  if (show_stats) {
+    stats_report("at exit");
   }
+  tty_outs_finish(); // what t3 itself has reported since
 
   // A fatal error surfacing only at flush/close still forces failure status.
   if (output_error_fatal) {
     return EXIT_FAILURE;
   }
+  if (pid == -1) {
+    return EXIT_FAILURE;
+  }
   return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
 }
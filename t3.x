@@ -79,13 +79,24 @@ status \fBreplaces the wrapped command's own exit status\fR, so a non-zero exit
 from
 .BR t3
 may indicate either that the command failed or that writing its output did.
+[BUFFERING]
+Most programs switch their \fIstdout\fR to full buffering when it is a pipe
+rather than a terminal, so without further help
+.BR t3
+receives, and timestamps, their output in blocks of several kilobytes.
+With \fB\-\-pty\fR the command's \fIstdout\fR and \fIstderr\fR are each
+connected to a pseudo-terminal of their own, so the command keeps the line
+buffering it would use on a real terminal and each line is stamped when it
+is written.
+The pseudo-terminals do no output processing, so line endings pass through
+unchanged.
 [BUGS]
-Lines are reassembled in full regardless of length, growing the
-internal buffer as needed up to a generous cap (16 MiB). A single
-line longer than that cap is forwarded in cap-sized pieces. No data
-is lost, but each piece is emitted as its own output line \(em with
-its own newline, timestamp, and color reset \(em so one input line
-longer than the cap appears as several lines in the output.
+A line longer than 1 MiB is not held in full: it is streamed on in
+1 MiB pieces as it arrives and written out as a single line, with one
+timestamp. While it is being written, the other stream's lines wait.
+For \fB\-\-highlight\fR and \fB\-\-grep\-out\fR such a line is judged
+by its first piece alone; it is never collapsed by
+\fB\-\-collapse\-repeats\fR nor elided by \fB\-\-tty\-max\-rate\fR.
 
 This program is specifically designed for processing
 line-buffered text terminal output, so unlike
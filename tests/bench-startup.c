@@ -0,0 +1,140 @@
+/*
+ * bench-startup.c - measure the fixed cost of whole, short t3 runs.
+ *
+ * tests/bench-overhead drives a million lines through t3, which deliberately
+ * amortizes startup and teardown away. This harness does the opposite: it
+ * runs a short command RUNS times and reports percentiles of
+ *
+ *   - wall time, from just before fork() to wait4() returning, and
+ *   - CPU time (user + system) as reported by wait4(), which for t3 covers
+ *     the parent and the worker processes it reaps before exiting.
+ *
+ * The command's stdout and stderr go to /dev/null. Run it once against the
+ * bare command too: the difference is what t3's fork/handshake/exit paths
+ * cost per invocation.
+ *
+ * Usage: bench-startup RUNS COMMAND [ARGS ...]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double timespec_us(const struct timespec *ts) {
+  return ts->tv_sec * 1e6 + ts->tv_nsec / 1e3;
+}
+
+static double timeval_us(const struct timeval *tv) {
+  return tv->tv_sec * 1e6 + tv->tv_usec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array.
+static double percentile(const double *sorted, long n, double p) {
+  long rank = (long)(p / 100.0 * n + 0.999999);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > n) {
+    rank = n;
+  }
+  return sorted[rank - 1];
+}
+
+static void report(const char *label, double *samples, long n) {
+  qsort(samples, (size_t)n, sizeof(*samples), cmp_double);
+  printf("%-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n", label,
+         percentile(samples, n, 50), percentile(samples, n, 90),
+         percentile(samples, n, 99), percentile(samples, n, 99.9),
+         samples[n - 1]);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: bench-startup RUNS COMMAND [ARGS ...]\n");
+    return EXIT_FAILURE;
+  }
+  errno = 0;
+  char *end;
+  long runs = strtol(argv[1], &end, 10);
+  if (end == argv[1] || *end != '\0' || errno == ERANGE || runs < 1 ||
+      runs > 10000000L) {
+    fprintf(stderr, "bench-startup: invalid RUNS '%s'\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  char **command = &argv[2];
+
+  int devnull = open("/dev/null", O_WRONLY);
+  if (devnull == -1) {
+    perror("/dev/null");
+    return EXIT_FAILURE;
+  }
+  double *wall = malloc((size_t)runs * sizeof(*wall));
+  double *cpu = malloc((size_t)runs * sizeof(*cpu));
+  if (!wall || !cpu) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+
+  long failures = 0;
+  for (long i = 0; i < runs; i++) {
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+      dup2(devnull, STDOUT_FILENO);
+      dup2(devnull, STDERR_FILENO);
+      execvp(command[0], command);
+      _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) == -1) {
+      if (errno != EINTR) {
+        perror("wait4");
+        return EXIT_FAILURE;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failures++;
+    }
+    wall[i] = timespec_us(&stop) - timespec_us(&start);
+    cpu[i] = timeval_us(&usage.ru_utime) + timeval_us(&usage.ru_stime);
+  }
+
+  printf("command:");
+  for (char **arg = command; *arg; arg++) {
+    printf(" %s", *arg);
+  }
+  printf("  (runs=%ld)\n", runs);
+  printf("%-8s %10s %10s %10s %10s %10s\n", "us", "p50", "p90", "p99",
+         "p99.9", "max");
+  report("wall", wall, runs);
+  report("cpu", cpu, runs);
+  if (failures) {
+    fprintf(stderr, "bench-startup: %ld of %ld runs failed\n", failures,
+            runs);
+  }
+
+  free(wall);
+  free(cpu);
+  close(devnull);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+/*
+ * latency.c - measure how long a line takes to get through t3.
+ *
+ * Two halves of one probe, meant to run on either side of t3:
+ *
+ *   latency gen RATE COUNT [both]
+ *       Write COUNT lines at RATE lines per second, each carrying the
+ *       CLOCK_MONOTONIC time of its write(2) as "latency <sec>.<nsec> <seq>".
+ *       Lines are paced against an absolute schedule, so a slow write does not
+ *       lower the offered rate. With "both", alternate lines go to stderr.
+ *
+ *   latency sink
+ *       Read t3's output from stdin, find the "latency " marker in each line
+ *       (so any timestamp or color prefix t3 adds is skipped), and report
+ *       percentiles of the delay between the generator's write and the
+ *       sink's read of that line.
+ *
+ * CLOCK_MONOTONIC is system-wide, so the two processes' readings compare
+ * directly. Example:
+ *
+ *     t3 -p /dev/null -- latency gen 1000 2000 2>&1 | latency sink
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MARKER "latency "
+
+static void write_all(int fd, const char *buf, size_t len) {
+  size_t off = 0;
+  while (off < len) {
+    ssize_t n = write(fd, buf + off, len - off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      _exit(EXIT_FAILURE);
+    }
+    off += (size_t)n;
+  }
+}
+
+// Parse a positive integer argument, rejecting non-numeric input, trailing
+// garbage, and overflow (anything outside [1, max]). Exits on error.
+static long parse_positive(const char *s, const char *name, long max) {
+  errno = 0;
+  char *end;
+  long v = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || v < 1 || v > max) {
+    fprintf(stderr, "latency: invalid %s '%s' (expected 1..%ld)\n", name, s,
+            max);
+    exit(EXIT_FAILURE);
+  }
+  return v;
+}
+
+static int gen(long rate, long count, int both) {
+  long interval_ns = 1000000000L / rate;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (long i = 0; i < count; i++) {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+           EINTR) {
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char line[64];
+    int len = snprintf(line, sizeof(line), MARKER "%lld.%09ld %ld\n",
+                       (long long)now.tv_sec, now.tv_nsec, i);
+    write_all((both && i % 2) ? STDERR_FILENO : STDOUT_FILENO, line,
+              (size_t)len);
+    next.tv_nsec += interval_ns;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array.
+static double percentile(const double *sorted, size_t n, double p) {
+  size_t rank = (size_t)(p / 100.0 * n + 0.999999);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > n) {
+    rank = n;
+  }
+  return sorted[rank - 1];
+}
+
+static int sink(void) {
+  size_t cap = 4096, n = 0;
+  double *delays = malloc(cap * sizeof(*delays));
+  char *line = NULL;
+  size_t line_cap = 0;
+  long unmatched = 0;
+  if (!delays) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+  while (getline(&line, &line_cap, stdin) != -1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const char *marker = strstr(line, MARKER);
+    long long sec;
+    long nsec;
+    if (!marker ||
+        sscanf(marker + strlen(MARKER), "%lld.%ld", &sec, &nsec) != 2) {
+      unmatched++;
+      continue;
+    }
+    if (n == cap) {
+      cap *= 2;
+      double *grown = realloc(delays, cap * sizeof(*delays));
+      if (!grown) {
+        perror("realloc");
+        return EXIT_FAILURE;
+      }
+      delays = grown;
+    }
+    delays[n++] = (now.tv_sec - sec) * 1e6 + (now.tv_nsec - nsec) / 1e3;
+  }
+  free(line);
+  if (n == 0) {
+    fprintf(stderr, "latency: no timestamped lines received\n");
+    free(delays);
+    return EXIT_FAILURE;
+  }
+  qsort(delays, n, sizeof(*delays), cmp_double);
+  printf("%8zu %10.1f %10.1f %10.1f %10.1f\n", n,
+         percentile(delays, n, 50), percentile(delays, n, 99),
+         percentile(delays, n, 99.9), delays[n - 1]);
+  if (unmatched) {
+    fprintf(stderr, "latency: %ld line(s) without a timestamp ignored\n",
+            unmatched);
+  }
+  free(delays);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc >= 4 && strcmp(argv[1], "gen") == 0) {
+    long rate = parse_positive(argv[2], "rate", 1000000000L);
+    long count = parse_positive(argv[3], "count", 1000000000L);
+    int both = (argc > 4 && strcmp(argv[4], "both") == 0);
+    return gen(rate, count, both);
+  }
+  if (argc == 2 && strcmp(argv[1], "sink") == 0) {
+    return sink();
+  }
+  fprintf(stderr, "Usage: latency gen RATE COUNT [both]\n"
+                  "       latency sink\n");
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,247 @@
+/*
+ * microbench.c - time t3's individual pipeline stages in isolation.
+ *
+ * tests/bench-overhead measures the whole binary, where fork, pipes and
+ * scheduling noise swamp small changes to any one stage. This harness
+ * compiles t3.c into itself (its main() renamed out of the way) and drives
+ * each stage directly on synthetic input:
+ *
+ *   split      timestamp_and_send(): the worker's read/line-split/frame loop,
+ *              reading a prebuilt file and writing frames to /dev/null
+ *   frames     framereader_fill() + framereader_next() over a prebuilt file
+ *              of frames
+ *   format     process_msg_payload() in each timestamp mode, with a JSON
+ *              Lines log and with --log-compact-cr, to /dev/null
+ *   drain      drain_queues() merging two pre-populated queues, to /dev/null
+ *   strip      ansi_strip() on plain lines and on lines carrying SGR escapes
+ *   match      match_line_rules() with a few --highlight/--grep-out rules
+ *
+ * Reports ns per line and the line-text throughput in MB/s. Build with
+ * optimization to get representative numbers, e.g.
+ * `make microbench OPTFLAGS=-O2`.
+ *
+ * Usage: microbench [count] [width]   (defaults: 200000 lines, 64 chars)
+ */
+
+#define main t3_main
+#include "../t3.c"
+#undef main
+
+// Where results are printed: the original stdout, saved before fd 1 is
+// pointed at /dev/null for the stages' own output.
+static FILE *results;
+static volatile size_t stripped_bytes;
+static volatile uint64_t matched_rules;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char *name, long count, long width, long long ns) {
+  fprintf(results, "%-22s %10ld %10.1f %10.1f\n", name, count,
+          (double)ns / count,
+          (double)count * width / ((double)ns / 1e9) / 1e6);
+}
+
+// A scratch file holding `count` lines of `width` bytes, either as raw
+// newline-terminated text (the worker's input) or as frames (the parent's).
+static int make_input(long count, long width, int framed) {
+  FILE *f = tmpfile();
+  if (!f) {
+    perror("tmpfile");
+    exit(EXIT_FAILURE);
+  }
+  char *line = xmalloc(sizeof(struct msg_header) + (size_t)width + 1);
+  struct msg_header header;
+  memset(&header, 0, sizeof(header));
+  if (framed) {
+    const char *handshake = "stdout started";
+    header.length = (uint32_t)strlen(handshake);
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(handshake, header.length, 1, f);
+  }
+  for (long i = 0; i < count; i++) {
+    memset(line, 'x', (size_t)width);
+    line[width] = '\n';
+    if (framed) {
+      header.timestamp.tv_sec = 1 + i / 1000000;
+      header.timestamp.tv_nsec = (i % 1000000) * 1000;
+      header.length = (uint32_t)width;
+      fwrite(&header, sizeof(header), 1, f);
+      fwrite(line, (size_t)width, 1, f);
+    } else {
+      fwrite(line, (size_t)width + 1, 1, f);
+    }
+  }
+  free(line);
+  fflush(f);
+  int fd = dup(fileno(f));
+  fclose(f);
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+static struct payload *make_payload(long width, long i) {
+  struct payload *msg_payload = xmalloc(sizeof(*msg_payload) + width + 1);
+  msg_payload->timestamp = start_timestamp;
+  msg_payload->timestamp.tv_sec += i / 1000000;
+  msg_payload->timestamp.tv_nsec = (i % 1000000) * 1000;
+  msg_payload->length = (uint32_t)width;
+  msg_payload->flags = 0;
+  memset(msg_payload->text, 'x', (size_t)width);
+  msg_payload->text[width] = '\0';
+  return msg_payload;
+}
+
+static void bench_split(long count, long width, int devnull) {
+  int fd = make_input(count, width, 0);
+  long long start = now_ns();
+  timestamp_and_send(devnull, fd, "stdout");
+  report("split", count, width, now_ns() - start);
+  close(fd);
+}
+
+static void bench_frames(long count, long width) {
+  int fd = make_input(count, width, 1);
+  struct framereader fr;
+  framereader_init(&fr, fd, "stdout");
+  long frames = 0;
+  long long start = now_ns();
+  int rc;
+  do {
+    rc = framereader_fill(&fr);
+    struct payload *msg_payload;
+    while ((msg_payload = framereader_next(&fr)) != NULL) {
+      free(msg_payload);
+      frames++;
+    }
+  } while (rc > 0);
+  long long elapsed = now_ns() - start;
+  if (frames != count) {
+    fprintf(results, "microbench: parsed %ld frames, expected %ld\n", frames,
+            count);
+    exit(EXIT_FAILURE);
+  }
+  report("frames", count, width, elapsed);
+  framereader_free(&fr);
+  close(fd);
+}
+
+static void bench_format(const char *name, long count, long width) {
+  struct payload *msg_payload = make_payload(width, 0);
+  long long start = now_ns();
+  for (long i = 0; i < count; i++) {
+    process_msg_payload(stdout, "", msg_payload);
+  }
+  report(name, count, width, now_ns() - start);
+  free(msg_payload);
+}
+
+static void bench_drain(long count, long width) {
+  for (long i = 0; i < count; i++) {
+    struct message *msg = xmalloc(sizeof(*msg));
+    msg->msg_payload = make_payload(width, i);
+    if (i % 2) {
+      push(&stderr_head, &stderr_tail, msg, &stderr_queuelen,
+           &stderr_queued_bytes);
+    } else {
+      push(&stdout_head, &stdout_tail, msg, &stdout_queuelen,
+           &stdout_queued_bytes);
+    }
+  }
+  long long start = now_ns();
+  drain_queues("", ANSI_COLOR_BOLD, &start_timestamp, 0);
+  report("drain", count, width, now_ns() - start);
+}
+
+static void bench_strip(const char *name, long count, long width,
+                        int colored) {
+  struct payload *msg_payload = make_payload(width, 0);
+  if (colored) {
+    for (long i = 0; i + 5 <= width; i += 16) {
+      memcpy(msg_payload->text + i, "\x1b[1m", 4);
+    }
+  }
+  struct ansi_stripper st = {ANSI_GROUND, NULL, 0};
+  size_t len;
+  long long start = now_ns();
+  for (long i = 0; i < count; i++) {
+    ansi_strip(&st, msg_payload->text, (size_t)width, &len);
+    stripped_bytes += len; // keep the call from being optimized away
+  }
+  report(name, count, width, now_ns() - start);
+  free(st.buf);
+  free(msg_payload);
+}
+
+static void bench_match(long count, long width) {
+  struct payload *msg_payload = make_payload(width, 0);
+  long long start = now_ns();
+  for (long i = 0; i < count; i++) {
+    matched_rules |= match_line_rules(msg_payload->text, (size_t)width);
+  }
+  report("match", count, width, now_ns() - start);
+  free(msg_payload);
+}
+
+int main(int argc, char *argv[]) {
+  long count = (argc > 1) ? strtol(argv[1], NULL, 10) : 200000;
+  long width = (argc > 2) ? strtol(argv[2], NULL, 10) : 64;
+  if (count < 1 || width < 1 || width > MAX_LINE_SIZE) {
+    fprintf(stderr, "Usage: microbench [count] [width]\n");
+    return EXIT_FAILURE;
+  }
+  clock_gettime(CLOCK_REALTIME, &start_timestamp);
+
+  // Everything the stages write - frames, log records, and the stdout/stderr
+  // renditions - goes to /dev/null; results go to the original stdout.
+  int devnull = open("/dev/null", O_WRONLY);
+  add_log_sink("logfile", "/dev/null", LOG_FORMAT_TEXT,
+               STREAM_STDOUT | STREAM_STDERR);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int saved_stderr = dup(STDERR_FILENO);
+  if (devnull == -1 || open_log_sinks(0) != 0 || saved_stdout == -1 ||
+      saved_stderr == -1) {
+    perror("microbench setup");
+    return EXIT_FAILURE;
+  }
+  results = fdopen(saved_stdout, "w");
+  setvbuf(results, NULL, _IOLBF, 0);
+  dup2(devnull, STDOUT_FILENO);
+  dup2(devnull, STDERR_FILENO);
+
+  fprintf(results, "count=%ld width=%ld\n", count, width);
+  fprintf(results, "%-22s %10s %10s %10s\n", "stage", "lines", "ns/line",
+          "MB/s");
+  bench_split(count, width, devnull);
+  bench_frames(count, width);
+  timestamp_enabled = 0;
+  bench_format("format/none", count, width);
+  timestamp_enabled = 1;
+  bench_format("format/absolute", count, width);
+  relative_timestamps = 1;
+  bench_format("format/relative", count, width);
+  timestamp_enabled = 0;
+  relative_timestamps = 0;
+  log_sinks[0].format = LOG_FORMAT_JSONL;
+  bench_format("format/jsonl", count, width);
+  log_sinks[0].format = LOG_FORMAT_TEXT;
+  compact_cr_log = 1;
+  bench_format("format/compact-cr", count, width);
+  compact_cr_log = 0;
+  bench_drain(count, width);
+  bench_strip("strip/plain", count, width, 0);
+  bench_strip("strip/colored", count, width, 1);
+  add_line_rule("error:|warning:|FAILED=red", 1);
+  add_line_rule("Entering directory|Leaving directory", 0);
+  build_line_matcher();
+  bench_match(count, width);
+
+  close_log_sinks(0);
+  fclose(results);
+  close(devnull);
+  dup2(saved_stderr, STDERR_FILENO);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,219 @@
+/*
+ * peakrss.c - report the peak resident set size of t3 and its workers.
+ *
+ * Runs COMMAND (a t3 invocation) with its stdout piped into a child that
+ * discards it, and its stderr sent to /dev/null. While COMMAND runs, it
+ * samples VmHWM (the kernel's high-water mark of resident memory) from
+ * /proc/<pid>/status for COMMAND itself and for each child of it running the
+ * same executable - t3's forked timestamp workers - but not the wrapped
+ * command, which has exec'd something else. When COMMAND exits, wait4()'s
+ * ru_maxrss adds the peak of the whole process tree.
+ *
+ * With PAUSE_MS > 0 the downstream reader is stopped (SIGSTOP) for that long
+ * as soon as COMMAND starts, so t3's consumer stalls and output backs up
+ * inside t3 exactly as it does behind a paused `| less`.
+ *
+ * Prints one line: parent and worker peaks, then the tree peak, in KiB.
+ * Linux-only, as it relies on /proc.
+ *
+ * Usage: peakrss PAUSE_MS COMMAND [ARGS ...]
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 8
+#define SAMPLE_INTERVAL_NS (5 * 1000 * 1000)
+
+struct tracked {
+  pid_t pid;
+  long hwm_kib;
+};
+
+// Read "Field:" from /proc/<pid>/status as a number, or -1 if unavailable.
+static long status_field(pid_t pid, const char *field) {
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+  long value = -1;
+  size_t flen = strlen(field);
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, field, flen) == 0) {
+      value = strtol(line + flen, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return value;
+}
+
+// Read /proc/<pid>/comm into buf (newline stripped); empty string on error.
+static void read_comm(pid_t pid, char *buf, size_t size) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+  buf[0] = '\0';
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return;
+  }
+  if (fgets(buf, (int)size, f)) {
+    buf[strcspn(buf, "\n")] = '\0';
+  }
+  fclose(f);
+}
+
+static void track(struct tracked *t, long hwm) {
+  if (hwm > t->hwm_kib) {
+    t->hwm_kib = hwm;
+  }
+}
+
+// Sample the parent, and discover and sample its same-named children.
+static void sample(struct tracked *parent, struct tracked *workers,
+                   int *nworkers) {
+  track(parent, status_field(parent->pid, "VmHWM:"));
+  char parent_comm[64];
+  read_comm(parent->pid, parent_comm, sizeof(parent_comm));
+
+  DIR *proc = opendir("/proc");
+  if (!proc) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(proc)) != NULL) {
+    char *end;
+    long pid = strtol(entry->d_name, &end, 10);
+    if (*end != '\0' || pid <= 0 ||
+        status_field((pid_t)pid, "PPid:") != parent->pid) {
+      continue;
+    }
+    char comm[64];
+    read_comm((pid_t)pid, comm, sizeof(comm));
+    if (strcmp(comm, parent_comm) != 0) {
+      continue; // the wrapped command
+    }
+    int i;
+    for (i = 0; i < *nworkers && workers[i].pid != pid; i++) {
+    }
+    if (i == *nworkers) {
+      if (*nworkers == MAX_WORKERS) {
+        continue;
+      }
+      workers[(*nworkers)++] = (struct tracked){(pid_t)pid, 0};
+    }
+    track(&workers[i], status_field((pid_t)pid, "VmHWM:"));
+  }
+  closedir(proc);
+}
+
+static int cmp_pid(const void *a, const void *b) {
+  return ((const struct tracked *)a)->pid - ((const struct tracked *)b)->pid;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: peakrss PAUSE_MS COMMAND [ARGS ...]\n");
+    return EXIT_FAILURE;
+  }
+  long pause_ms = strtol(argv[1], NULL, 10);
+  char **command = &argv[2];
+
+  int out[2];
+  if (pipe(out) == -1) {
+    perror("pipe");
+    return EXIT_FAILURE;
+  }
+
+  // Downstream reader: discard everything the command writes to stdout.
+  pid_t reader = fork();
+  if (reader == 0) {
+    close(out[1]);
+    char buf[65536];
+    while (read(out[0], buf, sizeof(buf)) > 0) {
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  close(out[0]);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(out[1]);
+    close(devnull);
+    execvp(command[0], command);
+    _exit(127);
+  }
+  close(out[1]);
+  if (reader == -1 || pid == -1) {
+    perror("fork");
+    return EXIT_FAILURE;
+  }
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int paused = 0;
+  if (pause_ms > 0) {
+    kill(reader, SIGSTOP);
+    paused = 1;
+  }
+
+  struct tracked parent = {pid, 0};
+  struct tracked workers[MAX_WORKERS];
+  int nworkers = 0;
+  int status;
+  struct rusage usage;
+  for (;;) {
+    sample(&parent, workers, &nworkers);
+    pid_t done = wait4(pid, &status, WNOHANG, &usage);
+    if (done == pid) {
+      break;
+    }
+    if (done == -1 && errno != EINTR) {
+      perror("wait4");
+      return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
+                      (now.tv_nsec - start.tv_nsec) / 1000000;
+    if (paused && elapsed_ms >= pause_ms) {
+      kill(reader, SIGCONT);
+      paused = 0;
+    }
+    struct timespec interval = {0, SAMPLE_INTERVAL_NS};
+    nanosleep(&interval, NULL);
+  }
+  if (paused) {
+    kill(reader, SIGCONT);
+  }
+  waitpid(reader, NULL, 0);
+
+  // Workers are forked in stream order, so sorting by pid lists the stdout
+  // worker first in the usual case of sequentially allocated pids.
+  qsort(workers, (size_t)nworkers, sizeof(*workers), cmp_pid);
+  printf("%10ld", parent.hwm_kib);
+  for (int i = 0; i < 2; i++) {
+    printf(" %10ld", i < nworkers ? workers[i].hwm_kib : -1L);
+  }
+  printf(" %10ld\n", usage.ru_maxrss);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "peakrss: command failed\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
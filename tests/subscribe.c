@@ -0,0 +1,84 @@
+/*
+ * subscribe.c - read t3's --listen socket, for the option tests.
+ *
+ * Connects to the Unix-domain socket SOCKET, retrying for up to five seconds
+ * while t3 is still creating it, then creates READY (if given) so a test can
+ * hold its command back until the subscription is in place, and copies
+ * everything t3 sends to stdout until t3 closes the connection.
+ *
+ * Usage: subscribe SOCKET [READY]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONNECT_ATTEMPTS 100
+#define CONNECT_INTERVAL_NS (50 * 1000 * 1000)
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: subscribe SOCKET [READY]\n");
+    return EXIT_FAILURE;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "subscribe: socket path too long\n");
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, argv[1]);
+
+  int fd = -1;
+  for (int i = 0; i < CONNECT_ATTEMPTS; i++) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+      perror("socket");
+      return EXIT_FAILURE;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+    struct timespec interval = {0, CONNECT_INTERVAL_NS};
+    nanosleep(&interval, NULL);
+  }
+  if (fd == -1) {
+    fprintf(stderr, "subscribe: cannot connect to %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  if (argc == 3) {
+    int ready = open(argv[2], O_WRONLY | O_CREAT, 0644);
+    if (ready == -1) {
+      perror(argv[2]);
+      return EXIT_FAILURE;
+    }
+    close(ready);
+  }
+
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("read");
+      return EXIT_FAILURE;
+    }
+    if (fwrite(buf, 1, (size_t)n, stdout) != (size_t)n) {
+      perror("fwrite");
+      return EXIT_FAILURE;
+    }
+  }
+  close(fd);
+  return EXIT_SUCCESS;
+}